@@ -22,8 +22,9 @@ typedef struct Decode {
   vaddr_t pc;
   vaddr_t snpc; // static next pc
   vaddr_t dnpc; // dynamic next pc
+  IFDEF(CONFIG_DECODE_CACHE, const void *handler); // body of the matched INSTPAT
   ISADecodeInfo isa;
-  IFDEF(CONFIG_ITRACE, char logbuf[128]);
+  IFDEF(CONFIG_ITRACE, IFNDEF(CONFIG_ITRACE_BINARY, char logbuf[128]));
 } Decode;
 
 // --- pattern matching mechanism ---
@@ -87,16 +88,84 @@ finish:
 
 
 // --- pattern matching wrappers for decode ---
-#define INSTPAT(pattern, ...) do { \
+#if !defined(CONFIG_DECODE_TREE)
+#define INSTPAT(pattern, ...) __INSTPAT(concat(__instpat_, __COUNTER__), pattern, ##__VA_ARGS__)
+#define __INSTPAT(label, pattern, ...) do { \
   uint64_t key, mask, shift; \
   pattern_decode(pattern, STRLEN(pattern), &key, &mask, &shift); \
   if ((((uint64_t)INSTPAT_INST(s) >> shift) & mask) == key) { \
+    IFDEF(CONFIG_DECODE_CACHE, s->handler = &&label; label:) \
     INSTPAT_MATCH(s, ##__VA_ARGS__); \
     goto *(__instpat_end); \
   } \
 } while (0)
 
-#define INSTPAT_START(name) { const void ** __instpat_end = &&concat(__instpat_end_, name);
+#define INSTPAT_START(name) { const void ** __instpat_end = &&concat(__instpat_end_, name); \
+  __INSTPAT_THREADED(s); \
+  IFDEF(CONFIG_DECODE_CACHE, if (s->handler != NULL) goto *(s->handler));
 #define INSTPAT_END(name)   concat(__instpat_end_, name): ; }
 
+#elif defined(DECODE_TREE_GEN)
+// Only the patterns are kept when tools/gen-decode reads the source file.
+#define INSTPAT(pattern, ...) __decode_tree_pat__(pattern)
+#define INSTPAT_START(name)   __decode_tree_start__(#name)
+#define INSTPAT_END(name)     __decode_tree_end__(#name)
+
+#else
+// With CONFIG_DECODE_TREE, tools/gen-decode turns each table of patterns
+// into a decision tree which returns the index of the first matching
+// pattern. The tree is in a header generated for every source file with
+// INSTPAT tables, and the patterns become the cases of a switch statement.
+#define INSTPAT(pattern, ...) __INSTPAT(__COUNTER__, pattern, ##__VA_ARGS__)
+#define __INSTPAT(id, pattern, ...) do { \
+  case (id) - __instpat_base - 1: \
+    IFDEF(CONFIG_DECODE_CACHE, s->handler = &&concat(__instpat_, id); concat(__instpat_, id):) \
+    INSTPAT_MATCH(s, ##__VA_ARGS__); \
+    goto *(__instpat_end); \
+} while (0)
+
+#define INSTPAT_START(name) { const void ** __instpat_end = &&concat(__instpat_end_, name); \
+  __INSTPAT_THREADED(s); \
+  IFDEF(CONFIG_DECODE_CACHE, if (s->handler != NULL) goto *(s->handler)); \
+  enum { __instpat_base = __COUNTER__ }; \
+  switch (concat(__decode_tree_, name)((uint64_t)INSTPAT_INST(s))) {
+#define INSTPAT_END(name)   } concat(__instpat_end_, name): ; \
+  static_assert(__COUNTER__ - __instpat_base - 1 == concat(__decode_tree_nr_, name), \
+      "the decode tree is out of date with the INSTPAT table"); }
+#endif
+
+#ifdef CONFIG_THREADED_DISPATCH
+/* Implemented by the engine: finish the instruction `s` which has just run,
+ * and return the next instruction if it should run right away and has been
+ * decoded before, otherwise return NULL. */
+Decode *threaded_next(Decode *s);
+// only instructions entered through their handler are threaded, the others
+// return to the engine to be traced once they are decoded
+#define __INSTPAT_THREADED(s) \
+  bool __instpat_threaded __attribute__((unused)) = ((s)->handler != NULL)
+// Used by the ISA at the end of an INSTPAT body. Jump to the handler of the
+// next instruction, so that each pattern has an indirect jump of its own.
+#define INSTPAT_DISPATCH(s) do { \
+  if (__instpat_threaded && ((s) = threaded_next(s)) != NULL) { \
+    (s)->dnpc = (s)->snpc; \
+    goto *((s)->handler); \
+  } \
+} while (0)
+#else
+#define __INSTPAT_THREADED(s)
+#define INSTPAT_DISPATCH(s)
+#endif
+
+// With CONFIG_DECODE_CACHE, a decoded instruction remembers the address of
+// its INSTPAT body and jumps there directly when it is executed again. These
+// addresses are only stable if the function holding the patterns is never
+// inlined or cloned, so mark it with INSTPAT_FUNC.
+#if !defined(CONFIG_DECODE_CACHE)
+#define INSTPAT_FUNC
+#elif defined(__clang__)
+#define INSTPAT_FUNC __attribute__((noinline))
+#else
+#define INSTPAT_FUNC __attribute__((noinline, noclone))
+#endif
+
 #endif
@@ -26,6 +26,13 @@ void difftest_set_patch(void (*fn)(void *arg), void *arg);
 void difftest_step(vaddr_t pc, vaddr_t npc);
 void difftest_detach();
 void difftest_attach();
+/* check the instructions run but not compared yet, roll back if they
+ * differ and return how many of them should be run again */
+int difftest_sync();
+#ifdef CONFIG_DIFFTEST_LOCKSTEP
+// record a store into pmem by the current instruction
+void difftest_commit_store(paddr_t addr, int len, word_t data);
+#endif
 #else
 static inline void difftest_skip_ref() {}
 static inline void difftest_skip_dut(int nr_ref, int nr_dut) {}
@@ -33,12 +40,15 @@ static inline void difftest_set_patch(void (*fn)(void *arg), void *arg) {}
 static inline void difftest_step(vaddr_t pc, vaddr_t npc) {}
 static inline void difftest_detach() {}
 static inline void difftest_attach() {}
+static inline int difftest_sync() { return 0; }
 #endif
 
 extern void (*ref_difftest_memcpy)(paddr_t addr, void *buf, size_t n, bool direction);
 extern void (*ref_difftest_regcpy)(void *dut, bool direction);
 extern void (*ref_difftest_exec)(uint64_t n);
 extern void (*ref_difftest_raise_intr)(uint64_t NO);
+// optional, get the hash of each page of pmem, see paddr_hash()
+extern void (*ref_difftest_memhash)(uint64_t *hash, size_t nr_page);
 
 static inline bool difftest_check_reg(const char *name, vaddr_t pc, word_t ref, word_t dut) {
   if (ref != dut) {
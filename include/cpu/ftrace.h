@@ -0,0 +1,33 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __CPU_FTRACE_H__
+#define __CPU_FTRACE_H__
+
+#include <cpu/decode.h>
+
+void init_ftrace();
+void ftrace_jump(Decode *s, vaddr_t dnpc);
+// print the call tree of the calls in the ring buffer
+void ftrace_dump(FILE *fp);
+// get the IDs of the innermost `max` functions being called, the outermost first
+int ftrace_stack(int32_t *frames, int max);
+
+// called for every instruction, only jumps can be calls or returns
+static inline void ftrace_exec(Decode *s, vaddr_t dnpc) {
+  if (dnpc != s->snpc) ftrace_jump(s, dnpc);
+}
+
+#endif
@@ -0,0 +1,51 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __CPU_ITRACE_H__
+#define __CPU_ITRACE_H__
+
+#include <common.h>
+
+// write the trace line of an instruction into `buf`
+void itrace_format(char *buf, int size, vaddr_t pc, uint8_t *inst, int ilen);
+
+#ifdef CONFIG_ITRACE_BINARY
+/* The binary instruction trace. Instructions are recorded into a ring buffer,
+ * which is appended to `itrace.bin` in the log directory whenever it is full.
+ * The file is a plain array of ItraceRecord in host byte order. */
+typedef struct {
+  vaddr_t pc;
+  uint32_t inst; // every ISA supported by the tracer has 4-byte instructions
+} ItraceRecord;
+
+extern ItraceRecord itrace_ring[CONFIG_ITRACE_RING_SIZE];
+extern uint64_t itrace_nr_record;
+
+void init_itrace(const char *log_dir);
+void itrace_write_block();
+// write the records not yet in the file
+void itrace_flush();
+// disassemble the last records to the screen and the log
+void itrace_dump();
+
+static inline void itrace_record(vaddr_t pc, uint32_t inst) {
+  ItraceRecord *r = &itrace_ring[itrace_nr_record % CONFIG_ITRACE_RING_SIZE];
+  r->pc = pc;
+  r->inst = inst;
+  if (++ itrace_nr_record % CONFIG_ITRACE_RING_SIZE == 0) itrace_write_block();
+}
+#endif
+
+#endif
@@ -0,0 +1,34 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __DEVICE_EVENT_H__
+#define __DEVICE_EVENT_H__
+
+#include <common.h>
+
+typedef void (*event_handler_t) ();
+
+// the guest instruction count at which the earliest event is due
+extern uint64_t g_event_deadline;
+
+// call `h` once after `delay` more guest instructions are executed
+void add_event(uint64_t delay, event_handler_t h);
+// call the handlers of the events which are due
+void event_run();
+/* keep the events due after the same number of instructions, when the
+ * instruction count is changed by `delta` */
+void event_shift(int64_t delta);
+
+#endif
@@ -20,6 +20,8 @@
 
 typedef void(*io_callback_t)(uint32_t, int, bool);
 uint8_t* new_space(int size);
+// the space allocated by new_space() so far, `size` is set to its length
+uint8_t* io_space_used(size_t *size);
 
 typedef struct {
   const char *name;
@@ -47,6 +49,7 @@ static inline int find_mapid_by_addr(IOMap *maps, int size, paddr_t addr) {
 
 void add_pio_map(const char *name, ioaddr_t addr,
         void *space, uint32_t len, io_callback_t callback);
+// a map without callback is accessed directly like plain memory
 void add_mmio_map(const char *name, paddr_t addr,
         void *space, uint32_t len, io_callback_t callback);
 
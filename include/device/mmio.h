@@ -20,5 +20,8 @@
 
 word_t mmio_read(paddr_t addr, int len);
 void mmio_write(paddr_t addr, int len, word_t data);
+/* return the host address of [addr, addr + len) if it is inside a map
+ * without callback, which can be accessed like plain memory, otherwise NULL */
+uint8_t *mmio_direct_space(paddr_t addr, int len);
 
 #endif
@@ -36,6 +36,8 @@ word_t isa_reg_str2val(const char *name, bool *success);
 // exec
 struct Decode;
 int isa_exec_once(struct Decode *s);
+// execute again an instruction already decoded by isa_exec_once()
+int isa_exec_decoded(struct Decode *s);
 
 // memory
 enum { MMU_DIRECT, MMU_TRANSLATE, MMU_FAIL };
@@ -55,4 +57,9 @@ word_t isa_query_intr();
 bool isa_difftest_checkregs(CPU_state *ref_r, vaddr_t pc);
 void isa_difftest_attach();
 
+// ftrace
+enum { FTRACE_NONE, FTRACE_CALL, FTRACE_RET };
+// tell whether the jump executed by `s` is a function call or return
+int isa_ftrace_kind(struct Decode *s);
+
 #endif
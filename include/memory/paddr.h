@@ -17,6 +17,7 @@
 #define __MEMORY_PADDR_H__
 
 #include <common.h>
+#include <memory/vaddr.h>
 
 #define PMEM_LEFT  ((paddr_t)CONFIG_MBASE)
 #define PMEM_RIGHT ((paddr_t)CONFIG_MBASE + CONFIG_MSIZE - 1)
@@ -33,5 +34,66 @@ static inline bool in_pmem(paddr_t addr) {
 
 word_t paddr_read(paddr_t addr, int len);
 void paddr_write(paddr_t addr, int len, word_t data);
+/* tell that [addr, addr + n) of pmem has been written without paddr_write(),
+ * which drops its hashes and the code cached from it */
+void paddr_invalidate(paddr_t addr, size_t n);
+
+#ifdef CONFIG_PMEM_GUARD
+// the size of the region reserved for pmem, covering the physical address space
+#define GUARD_SIZE (1ull << 32)
+/* An access outside of pmem faults on the guard pages. If the host pc of
+ * the access is not known by paddr_read() or paddr_write(), `fixup` is
+ * called with it, and should return where to continue, or 0 if the pc is
+ * not known either. */
+void paddr_guard_fixup(uintptr_t (*fixup)(uintptr_t pc));
+#endif
+
+#ifdef CONFIG_CODE_CACHE
+/* mark the page holding `addr` as containing code cached by the engine,
+ * the next store into this page will call `code_cache_invalidate()` */
+void paddr_set_code_page(paddr_t addr);
+// one flag for each page of pmem, set by `paddr_set_code_page()`
+extern bool pmem_code_page[];
+/* implemented by the engine, drop all cached code from the page of `addr` */
+void code_cache_invalidate(paddr_t addr);
+#endif
+
+#ifdef CONFIG_PMEM_HASH
+// the number of pages of pmem, each of which has a hash
+#define PMEM_NR_PAGE (CONFIG_MSIZE / PAGE_SIZE)
+// return the hash of each page of pmem
+const uint64_t *paddr_hash();
+#endif
+
+/* every store into pmem should go through paddr_write(), instead of being
+ * cached as a host address */
+#define PMEM_WRITE_HOOKED (ISDEF(CONFIG_DIFFTEST_BATCH) || \
+    ISDEF(CONFIG_DIFFTEST_LOCKSTEP) || ISDEF(CONFIG_PMEM_HASH))
+
+#ifdef CONFIG_DIFFTEST_BATCH
+// save the old content of each page of pmem before it is written from now on
+void paddr_undo_begin();
+/* restore the pages written since `paddr_undo_begin()`, and call `fn` with
+ * the address of each of them */
+void paddr_undo(void (*fn)(paddr_t page));
+#endif
+
+#ifndef CONFIG_TARGET_AM
+/* map [addr, addr + size) of pmem copy-on-write from the file `fd` at
+ * `offset`, return false if the host address, `size` or `offset` is not
+ * aligned to the page size of the host, or the file can not be mapped */
+bool paddr_map(paddr_t addr, size_t size, int fd, size_t offset);
+/* touch the pages of [addr, addr + n) of pmem before the host kernel writes
+ * into them, e.g. with read(), since pmem may be filled when it is touched,
+ * which only works for an access from user mode */
+void paddr_touch(paddr_t addr, size_t n);
+#endif
+
+#ifdef CONFIG_SNAPSHOT
+/* map pmem copy-on-write from the file `fd` at `offset`, which should be
+ * aligned to the page size of the host, and drop everything cached from the
+ * old content of pmem */
+void paddr_map_file(int fd, size_t offset);
+#endif
 
 #endif
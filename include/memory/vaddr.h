@@ -21,6 +21,11 @@
 word_t vaddr_ifetch(vaddr_t addr, int len);
 word_t vaddr_read(vaddr_t addr, int len);
 void vaddr_write(vaddr_t addr, int len, word_t data);
+/* drop all cached translations, the ISA should call it whenever the
+ * address space changes, e.g. on writes to satp and on sfence.vma */
+void vaddr_flush_tlb();
+// make stores into the pmem page of `addr` go through paddr_write() again
+void vaddr_flush_tlb_write(paddr_t addr);
 void not_exit_on_oob();
 bool is_oob();
 
@@ -0,0 +1,35 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __MONITOR_SNAPSHOT_H__
+#define __MONITOR_SNAPSHOT_H__
+
+#include <common.h>
+
+/* A snapshot file holds the cpu, pmem, the space of the devices allocated by
+ * new_space(), and the sections added below. Loading a snapshot maps pmem
+ * from the file, so only the pages touched afterwards are read. */
+
+// called with true before `data` is saved, and with false after it is loaded
+typedef void (*snapshot_hook_t)(bool is_save);
+
+/* save `size` bytes at `data` as the section `name`, which is the private
+ * state of a device kept outside the space from new_space() */
+void snapshot_add(const char *name, void *data, size_t size, snapshot_hook_t hook);
+
+bool snapshot_save(const char *file);
+bool snapshot_load(const char *file);
+
+#endif
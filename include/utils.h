@@ -34,6 +34,15 @@ extern NEMUState nemu_state;
 
 uint64_t get_time();
 
+// ----------- symbol -----------
+
+// read the functions in the symbol table of the guest ELF file
+void init_symbol(const char *elf_file);
+// the ID of the function containing `pc`, or -1 if there is none
+int symbol_find(vaddr_t pc);
+const char *symbol_name(int id);
+int symbol_count();
+
 // ----------- log -----------
 
 #define ANSI_FG_BLACK   "\33[1;30m"
@@ -65,17 +74,19 @@ uint64_t get_time();
 
 ENUM_TAB(log, log_type, set_log_id);
 
+// log files are fully buffered, see log_flush()
 #define log_write(type, ...) IFDEF(CONFIG_TARGET_NATIVE_ELF, \
   do { \
     extern FILE* log_fp[]; \
     extern bool log_enable(); \
     if (log_enable()) { \
       fprintf(log_fp[GETID(type, log)], __VA_ARGS__); \
-      fflush(log_fp[GETID(type, log)]); \
     } \
   } while (0) \
 )
 
+void log_flush();
+
 #define _Log(type, ...) \
   do { \
     printf(__VA_ARGS__); \
@@ -91,7 +102,6 @@ ENUM_TAB(log, log_type, set_log_id);
     if (!(cond)) { \
       MUXDEF(CONFIG_TARGET_AM, printf(ANSI_FMT(format, ANSI_FG_RED) "\n", ## __VA_ARGS__), \
         (fflush(stdout), fprintf(stderr, ANSI_FMT(format, ANSI_FG_RED) "\n", ##  __VA_ARGS__))); \
-      IFNDEF(CONFIG_TARGET_AM, extern FILE* log_fp[]; fflush(log_fp[GETID(nemu,log)])); \
       extern void assert_fail_msg(); \
       assert_fail_msg(); \
       assert(cond); \
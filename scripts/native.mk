@@ -17,6 +17,27 @@ include $(NEMU_HOME)/scripts/build.mk
 
 include $(NEMU_HOME)/tools/difftest.mk
 
+ifdef CONFIG_DECODE_TREE
+GEN_DECODE_PATH := $(NEMU_HOME)/tools/gen-decode
+GEN_DECODE := $(GEN_DECODE_PATH)/build/gen-decode
+DECODE_TREE_OBJS := $(patsubst %.c,$(OBJ_DIR)/%.o,$(shell grep -l INSTPAT_START $(SRCS)))
+
+$(GEN_DECODE):
+	$(Q)$(MAKE) $(silent) -C $(GEN_DECODE_PATH)
+
+# Generate the decision trees from the INSTPAT tables of a source file
+$(OBJ_DIR)/%.tree.h: %.c $(GEN_DECODE)
+	@echo + GEN $@
+	@mkdir -p $(dir $@)
+	@$(CC) $(CFLAGS) -DDECODE_TREE_GEN -E -MT $@ -MF $(@:.h=.d) -o $(@:.h=.i) $<
+	@$(GEN_DECODE) $(@:.h=.i) > $@.tmp
+	@mv $@.tmp $@
+
+$(DECODE_TREE_OBJS): $(OBJ_DIR)/%.o: $(OBJ_DIR)/%.tree.h
+$(DECODE_TREE_OBJS): private CFLAGS += -include $(@:.o=.tree.h)
+-include $(DECODE_TREE_OBJS:.o=.tree.d)
+endif
+
 compile_git:
 	$(call git_commit, "compile NEMU")
 # $(BINARY):: compile_git
@@ -16,7 +16,17 @@
 #include <cpu/cpu.h>
 #include <cpu/decode.h>
 #include <cpu/difftest.h>
+#include <cpu/itrace.h>
+#include <cpu/ftrace.h>
+#include <device/event.h>
 #include <locale.h>
+#if defined(CONFIG_ENGINE_TCACHE)
+#include <tcache.h>
+#elif defined(CONFIG_ENGINE_JIT)
+#include <jit.h>
+#elif defined(CONFIG_ICACHE)
+#include <icache.h>
+#endif
 
 /* The assembly code of instructions executed is only output to the screen
  * when the number of instructions executed is less than this value.
@@ -30,13 +40,22 @@ uint64_t g_nr_guest_inst = 0;
 static uint64_t g_timer = 0; // unit: us
 static bool g_print_step = false;
 
-void device_update();
-
 static void trace_and_difftest(Decode *_this, vaddr_t dnpc) {
+#ifdef CONFIG_ITRACE_BINARY
+  extern bool log_enable();
+  if (ITRACE_COND && log_enable()) { itrace_record(_this->pc, _this->isa.inst.val); }
+  if (g_print_step) {
+    char buf[128];
+    itrace_format(buf, sizeof(buf), _this->pc, (uint8_t *)&_this->isa.inst.val, _this->snpc - _this->pc);
+    puts(buf);
+  }
+#else
 #ifdef CONFIG_ITRACE_COND
   if (ITRACE_COND) { log_write(nemu, "%s\n", _this->logbuf); }
 #endif
   if (g_print_step) { IFDEF(CONFIG_ITRACE, puts(_this->logbuf)); }
+#endif
+  IFDEF(CONFIG_FTRACE, ftrace_exec(_this, dnpc));
   IFDEF(CONFIG_DIFFTEST, difftest_step(_this->pc, dnpc));
 
   extern void scan_watchpoint(vaddr_t pc);
@@ -48,42 +67,160 @@ static void exec_once(Decode *s, vaddr_t pc) {
   s->snpc = pc;
   isa_exec_once(s);
   cpu.pc = s->dnpc;
-#ifdef CONFIG_ITRACE
-  char *p = s->logbuf;
-  p += snprintf(p, sizeof(s->logbuf), FMT_WORD ":", fmt_word(s->pc));
-  int ilen = s->snpc - s->pc;
-  int i;
-  uint8_t *inst = (uint8_t *)&s->isa.inst.val;
-  for (i = ilen - 1; i >= 0; i --) {
-    p += snprintf(p, 4, " %02x", inst[i]);
-  }
-  int ilen_max = MUXDEF(CONFIG_ISA_x86, 8, 4);
-  int space_len = ilen_max - ilen;
-  if (space_len < 0) space_len = 0;
-  space_len = space_len * 3 + 1;
-  memset(p, ' ', space_len);
-  p += space_len;
-
-#ifndef CONFIG_ISA_loongarch32r
-  void disassemble(char *str, int size, uint64_t pc, uint8_t *code, int nbyte);
-  disassemble(p, s->logbuf + sizeof(s->logbuf) - p,
-      MUXDEF(CONFIG_ISA_x86, s->snpc, s->pc), (uint8_t *)&s->isa.inst.val, ilen);
-#else
-  p[0] = '\0'; // the upstream llvm does not support loongarch32r
+#if defined(CONFIG_ITRACE) && !defined(CONFIG_ITRACE_BINARY)
+  itrace_format(s->logbuf, sizeof(s->logbuf), s->pc, (uint8_t *)&s->isa.inst.val, s->snpc - s->pc);
 #endif
+}
+
+// return false if the execution should stop after this instruction
+static bool finish_inst(Decode *s) {
+  g_nr_guest_inst ++;
+  trace_and_difftest(s, cpu.pc);
+  if (nemu_state.state != NEMU_RUNNING) return false;
+  IFDEF(CONFIG_EVENT_QUEUE, if (g_nr_guest_inst >= g_event_deadline) event_run());
+  return true;
+}
+
+#ifdef CONFIG_ENGINE_TCACHE
+/* Replay the decoded instructions of `tb` until one of them jumps away.
+ * Return the number of instructions executed. */
+static uint64_t replay_block(TBlock *tb, uint64_t n) {
+  uint64_t i = 0;
+  while (i < tb->ninst && i < n) {
+    Decode *s = &tb->inst[i ++];
+    isa_exec_decoded(s);
+    cpu.pc = s->dnpc;
+    // also leave if a store has just modified the code of this block
+    if (!finish_inst(s) || s->dnpc != s->snpc || !tb->valid) break;
+  }
+  return i;
+}
+
+/* Interpret instructions from cpu.pc and record them into a new block.
+ * Return the number of instructions executed. */
+static uint64_t record_block(uint64_t n) {
+  TBlock *tb = tcache_new(cpu.pc);
+  if (tb == NULL) {
+    Decode s;
+    exec_once(&s, cpu.pc);
+    finish_inst(&s);
+    return 1;
+  }
+
+  uint64_t i = 0;
+  while (i < n) {
+    Decode *s = &tb->inst[tb->ninst ++];
+    exec_once(s, cpu.pc);
+    i ++;
+    // a block stopped from outside is not complete, drop it
+    if (!finish_inst(s)) break;
+    if (s->dnpc != s->snpc || tb_is_full(tb, cpu.pc)) {
+      tcache_commit(tb);
+      break;
+    }
+  }
+  return i;
+}
+
+static void execute(uint64_t n) {
+  while (n > 0 && nemu_state.state == NEMU_RUNNING) {
+    TBlock *tb = tcache_lookup(cpu.pc);
+    n -= (tb != NULL ? replay_block(tb, n) : record_block(n));
+  }
+}
+#elif defined(CONFIG_ENGINE_JIT)
+static void execute(uint64_t n) {
+  while (n > 0 && nemu_state.state == NEMU_RUNNING) {
+    // chained blocks stop at the next event, an event which is
+    // already due is left to finish_inst()
+    uint64_t budget = MIN(n, JIT_MAX_BUDGET);
+#ifdef CONFIG_EVENT_QUEUE
+    budget = (g_event_deadline > g_nr_guest_inst ? MIN(budget, g_event_deadline - g_nr_guest_inst) : 0);
 #endif
+    JitBlock *jb = jit_lookup(cpu.pc);
+    if (jb == NULL) jb = jit_translate(cpu.pc);
+    if (jb == NULL || jb->ninst == 0 || jb->ninst > budget) {
+      // not translated, or the block may run past the budget
+      Decode s;
+      exec_once(&s, cpu.pc);
+      finish_inst(&s);
+      n --;
+      continue;
+    }
+
+    Decode s = { .pc = cpu.pc };
+    uint64_t ninst = jit_run(jb, budget);
+    g_nr_guest_inst += ninst;
+    n -= ninst;
+    trace_and_difftest(&s, cpu.pc);
+    IFDEF(CONFIG_EVENT_QUEUE, if (g_nr_guest_inst >= g_event_deadline) event_run());
+  }
+}
+#elif defined(CONFIG_THREADED_DISPATCH)
+static uint64_t threaded_left = 0;
+
+Decode *threaded_next(Decode *s) {
+  cpu.pc = s->dnpc;
+  threaded_left --;
+  if (!finish_inst(s) || threaded_left == 0) return NULL;
+  return icache_lookup(cpu.pc);
 }
 
+static void execute(uint64_t n) {
+  Decode uncached;
+  threaded_left = n;
+  while (threaded_left > 0 && nemu_state.state == NEMU_RUNNING) {
+    Decode *s = icache_lookup(cpu.pc);
+    if (s != NULL) {
+      // run until an instruction is not cached, all of them are finished
+      // by threaded_next()
+      isa_exec_decoded(s);
+      continue;
+    }
+    s = icache_fill(cpu.pc);
+    if (s == NULL) s = &uncached;
+    exec_once(s, cpu.pc);
+    threaded_left --;
+    finish_inst(s);
+  }
+}
+#elif defined(CONFIG_ICACHE)
+static void execute(uint64_t n) {
+  Decode uncached;
+  for (;n > 0; n --) {
+    Decode *s = icache_lookup(cpu.pc);
+    if (s != NULL) {
+      isa_exec_decoded(s);
+      cpu.pc = s->dnpc;
+    } else {
+      s = icache_fill(cpu.pc);
+      if (s == NULL) s = &uncached;
+      exec_once(s, cpu.pc);
+    }
+    if (!finish_inst(s)) break;
+  }
+}
+#else
 static void execute(uint64_t n) {
   Decode s;
   for (;n > 0; n --) {
     exec_once(&s, cpu.pc);
-    g_nr_guest_inst ++;
-    trace_and_difftest(&s, cpu.pc);
-    if (nemu_state.state != NEMU_RUNNING) break;
-    IFDEF(CONFIG_DEVICE, device_update());
+    if (!finish_inst(&s)) break;
   }
 }
+#endif
+
+#ifdef CONFIG_DIFFTEST
+/* A batch of DiffTest may still be unchecked when NEMU stops or fails.
+ * Check it, and if it differs, run it again one instruction at a time,
+ * which stops at the first one differing from the reference design. */
+static void difftest_flush() {
+  int n = difftest_sync();
+  if (n == 0) return;
+  nemu_state.state = NEMU_RUNNING;
+  execute(n);
+}
+#endif
 
 static void statistic() {
   IFNDEF(CONFIG_TARGET_AM, setlocale(LC_NUMERIC, ""));
@@ -95,13 +232,23 @@ static void statistic() {
 }
 
 void assert_fail_msg() {
+  // an instruction run again may fail in the same way
+  static bool failing = false;
+  if (!failing) {
+    failing = true;
+    IFDEF(CONFIG_DIFFTEST, difftest_flush());
+  }
+  IFDEF(CONFIG_ITRACE_BINARY, itrace_dump());
+  IFDEF(CONFIG_ITRACE_BINARY, itrace_flush());
   isa_reg_display();
   statistic();
+  IFNDEF(CONFIG_TARGET_AM, log_flush());
 }
 
 /* Simulate how the CPU works. */
 void cpu_exec(uint64_t n) {
-  g_print_step = (n < MAX_INST_TO_PRINT);
+  // a reference design runs silently however few instructions it is asked for
+  g_print_step = (n < MAX_INST_TO_PRINT) && ISNDEF(CONFIG_TARGET_SHARE);
   switch (nemu_state.state) {
     case NEMU_END: case NEMU_ABORT:
       printf("Program execution has ended. To restart the program, exit NEMU and run again.\n");
@@ -112,6 +259,7 @@ void cpu_exec(uint64_t n) {
   uint64_t timer_start = get_time();
 
   execute(n);
+  IFDEF(CONFIG_DIFFTEST, difftest_flush());
 
   uint64_t timer_end = get_time();
   g_timer += timer_end - timer_start;
@@ -125,7 +273,11 @@ void cpu_exec(uint64_t n) {
            (nemu_state.halt_ret == 0 ? ANSI_FMT("HIT GOOD TRAP", ANSI_FG_GREEN) :
             ANSI_FMT("HIT BAD TRAP", ANSI_FG_RED))),
           fmt_word(nemu_state.halt_pc));
+      IFDEF(CONFIG_ITRACE_BINARY, if (nemu_state.state == NEMU_ABORT) itrace_dump());
       // fall through
     case NEMU_QUIT: statistic();
   }
+
+  // make the log up to date when control returns to the debugger
+  IFDEF(CONFIG_TARGET_NATIVE_ELF, log_flush());
 }
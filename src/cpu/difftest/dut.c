@@ -19,19 +19,273 @@
 #include <isa.h>
 #include <cpu/cpu.h>
 #include <memory/paddr.h>
+#include <memory/vaddr.h>
 #include <utils.h>
 #include <difftest-def.h>
+#ifdef CONFIG_DIFFTEST_LOCKSTEP
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
 
 void (*ref_difftest_memcpy)(paddr_t addr, void *buf, size_t n, bool direction) = NULL;
 void (*ref_difftest_regcpy)(void *dut, bool direction) = NULL;
 void (*ref_difftest_exec)(uint64_t n) = NULL;
 void (*ref_difftest_raise_intr)(uint64_t NO) = NULL;
+void (*ref_difftest_memhash)(uint64_t *hash, size_t nr_page) = NULL;
 
 #ifdef CONFIG_DIFFTEST
 
 static bool is_skip_ref = false;
 static int skip_dut_nr_inst = 0;
 
+#ifdef CONFIG_DIFFTEST_MEM_HASH
+static int mem_check_left = CONFIG_DIFFTEST_MEM_HASH_INTERVAL;
+
+// compare the hashes of pmem pages if it is time, the reference design
+// should have run the same instructions as NEMU
+static void check_mem(vaddr_t pc) {
+  if (mem_check_left > 0 || ref_difftest_memhash == NULL) return;
+  mem_check_left = CONFIG_DIFFTEST_MEM_HASH_INTERVAL;
+  static uint64_t ref_hash[PMEM_NR_PAGE];
+  ref_difftest_memhash(ref_hash, PMEM_NR_PAGE);
+  const uint64_t *hash = paddr_hash();
+  for (int i = 0; i < PMEM_NR_PAGE; i ++) {
+    if (hash[i] != ref_hash[i]) {
+      Log("pmem page at " FMT_PADDR " is different after executing instruction at pc = " FMT_WORD
+          ", it has been written by one of the last %d instructions",
+          fmt_paddr((paddr_t)(CONFIG_MBASE + i * PAGE_SIZE)), fmt_word(pc), CONFIG_DIFFTEST_MEM_HASH_INTERVAL);
+      nemu_state.state = NEMU_ABORT;
+      nemu_state.halt_pc = pc;
+      return;
+    }
+  }
+}
+#endif
+
+#ifdef CONFIG_DIFFTEST_LOCKSTEP
+/* NEMU appends a commit record for each instruction to a ring, and another
+ * thread steps the reference design and checks it against the records. The
+ * checker keeps the registers NEMU is expected to have, so that a record
+ * only holds the words of CPU_state which the instruction has changed. */
+#define RING_SIZE 4096
+// instructions changing more words, such as the pc and two registers, are
+// checked in place
+#define MAX_CHANGE 3
+#define NR_REG_WORD (DIFFTEST_REG_SIZE / sizeof(word_t))
+
+typedef struct {
+  uint64_t nr_inst;
+  vaddr_t pc;
+  int nchange;
+  uint8_t idx[MAX_CHANGE];
+  word_t val[MAX_CHANGE];
+  int store_len; // 0 if the instruction does not store into pmem
+  paddr_t store_addr;
+  word_t store_data;
+} Commit;
+
+extern uint64_t g_nr_guest_inst;
+static Commit ring[RING_SIZE];
+// the next record to write by NEMU, and the next one to check by the checker
+static uint64_t ring_head = 0, ring_tail = 0;
+// the record of the current instruction
+static Commit commit = {};
+// the registers after the last instruction in the ring
+static CPU_state shadow;
+// the registers after the last instruction checked, only written by NEMU
+// when the ring is empty
+static CPU_state expect;
+static bool failed = false;
+static Commit fail;
+static CPU_state fail_ref;
+
+static void ring_wait(int *spin) {
+  if (++ *spin < 1024) sched_yield();
+  else usleep(100);
+}
+
+static void *checker(void *arg) {
+  int spin = 0;
+  while (true) {
+    uint64_t tail = ring_tail;
+    if (__atomic_load_n(&ring_head, __ATOMIC_ACQUIRE) == tail) { ring_wait(&spin); continue; }
+    spin = 0;
+
+    Commit *c = &ring[tail % RING_SIZE];
+    for (int i = 0; i < c->nchange; i ++) ((word_t *)&expect)[c->idx[i]] = c->val[i];
+    CPU_state ref_r;
+    ref_difftest_exec(1);
+    ref_difftest_regcpy(&ref_r, DIFFTEST_TO_DUT);
+    bool ok = (memcmp(&ref_r, &expect, DIFFTEST_REG_SIZE) == 0);
+    if (ok && c->store_len > 0) {
+      word_t data = 0;
+      ref_difftest_memcpy(c->store_addr, &data, c->store_len, DIFFTEST_TO_DUT);
+      ok = (data == c->store_data);
+    }
+    if (!ok) {
+      fail = *c;
+      fail_ref = ref_r;
+      __atomic_store_n(&failed, true, __ATOMIC_RELEASE);
+      return NULL;
+    }
+    __atomic_store_n(&ring_tail, tail + 1, __ATOMIC_RELEASE);
+  }
+}
+
+static bool lockstep_failed() {
+  if (!__atomic_load_n(&failed, __ATOMIC_ACQUIRE)) return false;
+  if (nemu_state.state == NEMU_ABORT) return true;
+
+  // NEMU has run ahead, so compare with the registers it had at that time
+  Log("Differential testing: instruction #%" PRIu64 " at pc = " FMT_WORD " differs",
+      fail.nr_inst, fmt_word(fail.pc));
+  if (memcmp(&fail_ref, &expect, DIFFTEST_REG_SIZE) != 0) {
+    CPU_state dut = cpu;
+    cpu = expect;
+    isa_difftest_checkregs(&fail_ref, expect.pc);
+    cpu = dut;
+  } else {
+    Log("the store of %d bytes to " FMT_PADDR " differs, NEMU stored " FMT_WORD,
+        fail.store_len, fmt_paddr(fail.store_addr), fmt_word(fail.store_data));
+  }
+  nemu_state.state = NEMU_ABORT;
+  nemu_state.halt_pc = fail.pc;
+  return true;
+}
+
+// wait for the checker to catch up, then the reference design can be used
+// by NEMU, return false if the checker has found a difference
+static bool lockstep_drain() {
+  int spin = 0;
+  while (__atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE) != ring_head) {
+    if (lockstep_failed()) return false;
+    ring_wait(&spin);
+  }
+  return !lockstep_failed();
+}
+
+// called after the reference design is synchronized with NEMU
+static void lockstep_sync() {
+  shadow = cpu;
+  expect = cpu;
+  commit.store_len = 0;
+}
+
+void difftest_commit_store(paddr_t addr, int len, word_t data) {
+  commit.store_addr = addr;
+  commit.store_len = len;
+  commit.store_data = 0;
+  memcpy(&commit.store_data, &data, len);
+}
+
+// return false if the current instruction should be checked in place
+static bool lockstep_step(vaddr_t pc) {
+  if (lockstep_failed()) return true;
+  if (is_skip_ref || skip_dut_nr_inst > 0) return !lockstep_drain();
+
+  word_t *now = (word_t *)&cpu, *old = (word_t *)&shadow;
+  commit.nchange = 0;
+  for (int i = 0; i < NR_REG_WORD; i ++) {
+    if (now[i] == old[i]) continue;
+    if (commit.nchange == MAX_CHANGE) return !lockstep_drain();
+    commit.idx[commit.nchange] = i;
+    commit.val[commit.nchange ++] = now[i];
+    old[i] = now[i];
+  }
+  commit.nr_inst = g_nr_guest_inst;
+  commit.pc = pc;
+
+  int spin = 0;
+  while (ring_head - __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE) == RING_SIZE) {
+    if (lockstep_failed()) return true;
+    ring_wait(&spin);
+  }
+  ring[ring_head % RING_SIZE] = commit;
+  __atomic_store_n(&ring_head, ring_head + 1, __ATOMIC_RELEASE);
+  commit.store_len = 0;
+  IFDEF(CONFIG_DIFFTEST_MEM_HASH, if (mem_check_left <= 0 && lockstep_drain()) check_mem(pc));
+  return true;
+}
+#endif
+
+#ifdef CONFIG_DIFFTEST_BATCH
+/* NEMU runs a batch of instructions before the reference design catches up
+ * and the registers are compared. Stores in the batch are logged by
+ * paddr_undo_begin(), so that both sides can be rolled back to the start of
+ * the batch, which is then checked one instruction at a time. */
+extern uint64_t g_nr_guest_inst;
+// the state at the start of the batch, agreed on by the reference design
+static CPU_state batch_start;
+static uint64_t batch_start_nr_inst = 0;
+// the state before the current instruction
+static CPU_state last;
+// instructions in the batch which the reference design has not run yet
+static int batch_nr_inst = 0;
+// instructions left to check one by one after a rollback
+static int rerun_nr_inst = 0;
+
+static void batch_begin() {
+  batch_start = cpu;
+  last = cpu;
+  batch_start_nr_inst = g_nr_guest_inst;
+  batch_nr_inst = 0;
+  paddr_undo_begin();
+}
+
+// let the reference design run the batch, return whether it agrees with `dut`
+static bool batch_sync(CPU_state *dut) {
+  CPU_state ref_r;
+  ref_difftest_exec(batch_nr_inst);
+  ref_difftest_regcpy(&ref_r, DIFFTEST_TO_DUT);
+  return memcmp(&ref_r, dut, DIFFTEST_REG_SIZE) == 0;
+}
+
+static void copy_page_to_ref(paddr_t page) {
+  ref_difftest_memcpy(page, guest_to_host(page), PAGE_SIZE, DIFFTEST_TO_REF);
+}
+
+static void batch_rollback() {
+  Log("Differential testing: the batch from pc = " FMT_WORD " differs, "
+      "rolling back %d instructions to check them one by one",
+      fmt_word(batch_start.pc), batch_nr_inst);
+  rerun_nr_inst = batch_nr_inst;
+  is_skip_ref = false;
+  skip_dut_nr_inst = 0;
+  cpu = batch_start;
+  g_nr_guest_inst = batch_start_nr_inst;
+  // the instruction which has just ended the program will be run again
+  if (nemu_state.state == NEMU_END) nemu_state.state = NEMU_RUNNING;
+  paddr_undo(copy_page_to_ref);
+  ref_difftest_regcpy(&cpu, DIFFTEST_TO_REF);
+  batch_begin();
+}
+
+// return false if the current instruction should be checked by itself
+static bool batch_step() {
+  if (rerun_nr_inst > 0) {
+    rerun_nr_inst --;
+    return false;
+  }
+  if (is_skip_ref || skip_dut_nr_inst > 0) {
+    // the reference design should not run this instruction, catch up with
+    // the state before it first
+    if (batch_nr_inst > 0 && !batch_sync(&last)) { batch_rollback(); return true; }
+    return false;
+  }
+  if (++ batch_nr_inst < CONFIG_DIFFTEST_BATCH_SIZE) {
+    last = cpu;
+    return true;
+  }
+  if (batch_sync(&cpu)) {
+    batch_begin();
+    IFDEF(CONFIG_DIFFTEST_MEM_HASH, check_mem(cpu.pc));
+  }
+  else batch_rollback();
+  return true;
+}
+#endif
+
 // this is used to let ref skip instructions which
 // can not produce consistent behavior with NEMU
 void difftest_skip_ref() {
@@ -53,6 +307,20 @@ void difftest_skip_ref() {
 //   Let REF run `nr_ref` instructions first.
 //   We expect that DUT will catch up with REF within `nr_dut` instructions.
 void difftest_skip_dut(int nr_ref, int nr_dut) {
+  IFDEF(CONFIG_DIFFTEST_LOCKSTEP, if (!lockstep_drain()) return);
+#ifdef CONFIG_DIFFTEST_BATCH
+  // this is called in the middle of an instruction, which can not be
+  // rolled back, so the batch before it is only checked
+  if (batch_nr_inst > 0) {
+    if (!batch_sync(&last)) {
+      Log("Differential testing: the batch from pc = " FMT_WORD " to pc = " FMT_WORD " differs",
+          fmt_word(batch_start.pc), fmt_word(last.pc));
+      nemu_state.state = NEMU_ABORT;
+      nemu_state.halt_pc = last.pc;
+    }
+    batch_nr_inst = 0;
+  }
+#endif
   skip_dut_nr_inst += nr_dut;
 
   while (nr_ref -- > 0) {
@@ -60,6 +328,21 @@ void difftest_skip_dut(int nr_ref, int nr_dut) {
   }
 }
 
+int difftest_sync() {
+#ifdef CONFIG_DIFFTEST_BATCH
+  // the instructions being run again are checked one by one
+  if (batch_nr_inst == 0 || rerun_nr_inst > 0) return 0;
+  if (batch_sync(&last)) {
+    batch_begin();
+    return 0;
+  }
+  batch_rollback();
+  return rerun_nr_inst;
+#else
+  return 0;
+#endif
+}
+
 void init_difftest(char *ref_so_file, long img_size, int port) {
   assert(ref_so_file != NULL);
 
@@ -90,6 +373,28 @@ void init_difftest(char *ref_so_file, long img_size, int port) {
   ref_difftest_init(port);
   ref_difftest_memcpy(RESET_VECTOR, guest_to_host(RESET_VECTOR), img_size, DIFFTEST_TO_REF);
   ref_difftest_regcpy(&cpu, DIFFTEST_TO_REF);
+#ifdef CONFIG_DIFFTEST_MEM_HASH
+  // optional, only provided by some reference designs
+  ref_difftest_memhash = dlsym(handle, "difftest_memhash");
+  if (ref_difftest_memhash != NULL) {
+    Log("Memory is compared every %d instructions.", CONFIG_DIFFTEST_MEM_HASH_INTERVAL);
+    // all of pmem is compared, not only the image
+    ref_difftest_memcpy(CONFIG_MBASE, guest_to_host(CONFIG_MBASE), CONFIG_MSIZE, DIFFTEST_TO_REF);
+  } else {
+    Log("%s does not provide difftest_memhash(), memory is not compared.", ref_so_file);
+  }
+#endif
+#ifdef CONFIG_DIFFTEST_BATCH
+  Log("Registers are compared every %d instructions.", CONFIG_DIFFTEST_BATCH_SIZE);
+  batch_begin();
+#endif
+#ifdef CONFIG_DIFFTEST_LOCKSTEP
+  Log("The reference design is checked on another thread.");
+  lockstep_sync();
+  pthread_t thread;
+  int ret = pthread_create(&thread, NULL, checker, NULL);
+  Assert(ret == 0, "Can not create the difftest thread");
+#endif
 }
 
 static void checkregs(CPU_state *ref, vaddr_t pc) {
@@ -100,7 +405,7 @@ static void checkregs(CPU_state *ref, vaddr_t pc) {
   }
 }
 
-void difftest_step(vaddr_t pc, vaddr_t npc) {
+static void step_one(vaddr_t pc, vaddr_t npc) {
   CPU_state ref_r;
 
   if (skip_dut_nr_inst > 0) {
@@ -128,6 +433,22 @@ void difftest_step(vaddr_t pc, vaddr_t npc) {
 
   checkregs(&ref_r, npc);
 }
+
+void difftest_step(vaddr_t pc, vaddr_t npc) {
+  IFDEF(CONFIG_DIFFTEST_MEM_HASH, mem_check_left --);
+#ifdef CONFIG_DIFFTEST_BATCH
+  if (batch_step()) return;
+  step_one(pc, npc);
+  batch_begin();
+#elif defined(CONFIG_DIFFTEST_LOCKSTEP)
+  if (lockstep_step(pc)) return;
+  step_one(pc, npc);
+  lockstep_sync();
+#else
+  step_one(pc, npc);
+#endif
+  IFDEF(CONFIG_DIFFTEST_MEM_HASH, if (nemu_state.state != NEMU_ABORT) check_mem(pc));
+}
 #else
 void init_difftest(char *ref_so_file, long img_size, int port) { }
 #endif
@@ -17,22 +17,47 @@
 #include <cpu/cpu.h>
 #include <difftest-def.h>
 #include <memory/paddr.h>
+#include <memory/vaddr.h>
+
+/* NEMU built as a shared object (TARGET_SHARE) can be the reference design
+ * of another NEMU, e.g. an interpreter checking a JIT. It is stepped in the
+ * same process, and registers are copied as the first DIFFTEST_REG_SIZE
+ * bytes of CPU_state, the same layout as the other reference designs. */
 
 __EXPORT void difftest_memcpy(paddr_t addr, void *buf, size_t n, bool direction) {
-  assert(0);
+  assert(in_pmem(addr) && in_pmem(addr + n - 1));
+  if (direction == DIFFTEST_TO_DUT) {
+    memcpy(buf, guest_to_host(addr), n);
+    return;
+  }
+  memcpy(guest_to_host(addr), buf, n);
+  paddr_invalidate(addr, n);
 }
 
 __EXPORT void difftest_regcpy(void *dut, bool direction) {
-  assert(0);
+  if (direction == DIFFTEST_TO_DUT) {
+    memcpy(dut, &cpu, DIFFTEST_REG_SIZE);
+    return;
+  }
+  memcpy(&cpu, dut, DIFFTEST_REG_SIZE);
+  // the state may resume a program which the reference design has ended
+  nemu_state.state = NEMU_STOP;
 }
 
 __EXPORT void difftest_exec(uint64_t n) {
-  assert(0);
+  cpu_exec(n);
 }
 
 __EXPORT void difftest_raise_intr(word_t NO) {
-  assert(0);
+  cpu.pc = isa_raise_intr(NO, cpu.pc);
+}
+
+#ifdef CONFIG_PMEM_HASH
+__EXPORT void difftest_memhash(uint64_t *hash, size_t nr_page) {
+  assert(nr_page == PMEM_NR_PAGE);
+  memcpy(hash, paddr_hash(), sizeof(uint64_t) * nr_page);
 }
+#endif
 
 __EXPORT void difftest_init(int port) {
   void init_mem();
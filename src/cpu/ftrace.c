@@ -0,0 +1,165 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <cpu/ftrace.h>
+
+#ifdef CONFIG_FTRACE
+
+/* A call or a return. The number of instructions executed between a call
+ * and its return is the inclusive count of the function. */
+typedef struct {
+  uint64_t nr_inst; // g_nr_guest_inst after the jump
+  vaddr_t pc;       // target of a call, or address of a return
+  int32_t sym;      // function called or returned from, -1 if unknown
+  uint8_t kind;
+} FtraceRecord;
+
+static FtraceRecord ring[CONFIG_FTRACE_RING_SIZE];
+static uint64_t nr_record = 0;
+
+// the functions being called, only the innermost STACK_SIZE are kept
+#define STACK_SIZE 256
+static int32_t call_stack[STACK_SIZE];
+static int call_depth = 0;
+
+extern uint64_t g_nr_guest_inst;
+
+static void dump_at_exit() {
+  extern FILE *log_fp[];
+  FILE *fp = log_fp[GETID(func, log)];
+  if (fp != stdout) ftrace_dump(fp);
+}
+
+void init_ftrace() {
+  atexit(dump_at_exit);
+}
+
+void ftrace_jump(Decode *s, vaddr_t dnpc) {
+  int kind = isa_ftrace_kind(s);
+  if (kind == FTRACE_NONE) return;
+  vaddr_t pc = (kind == FTRACE_CALL ? dnpc : s->pc);
+  int32_t id = symbol_find(pc);
+  ring[nr_record % CONFIG_FTRACE_RING_SIZE] = (FtraceRecord) {
+    .nr_inst = g_nr_guest_inst, .pc = pc, .sym = id, .kind = kind };
+  nr_record ++;
+
+  if (kind == FTRACE_CALL) call_stack[call_depth ++ % STACK_SIZE] = id;
+  else if (call_depth > 0) call_depth --;
+}
+
+int ftrace_stack(int32_t *frames, int max) {
+  int n = MIN(call_depth, MIN(max, STACK_SIZE));
+  for (int i = 0; i < n; i ++) {
+    frames[i] = call_stack[(call_depth - n + i) % STACK_SIZE];
+  }
+  return n;
+}
+
+typedef struct {
+  int32_t sym;
+  vaddr_t pc;
+  int depth;
+  bool returned;
+  bool outermost; // not called by another call of the same function
+  uint64_t start, incl, child;
+} Node;
+
+static void print_name(FILE *fp, int32_t id, vaddr_t pc) {
+  if (id != -1) fprintf(fp, "%s", symbol_name(id));
+  else fprintf(fp, "??? [" FMT_WORD "]", fmt_word(pc));
+}
+
+static uint64_t *excl_sum = NULL;
+static int excl_cmp(const void *a, const void *b) {
+  uint64_t x = excl_sum[*(const int *)a], y = excl_sum[*(const int *)b];
+  return (x < y) - (x > y);
+}
+
+void ftrace_dump(FILE *fp) {
+  int nr_sym = symbol_count();
+  uint64_t first = (nr_record > CONFIG_FTRACE_RING_SIZE ? nr_record - CONFIG_FTRACE_RING_SIZE : 0);
+  Node *node = malloc(sizeof(Node) * (nr_record - first + 1));
+  int *stack = malloc(sizeof(int) * (nr_record - first + 1));
+  // the number of calls of each function on the stack, the last entry
+  // collects the unknown functions
+  int *active = calloc(nr_sym + 1, sizeof(int));
+  int nr_node = 0, sp = 0;
+#define sym_idx(id) ((id) == -1 ? nr_sym : (id))
+
+  // rebuild the calls, a return without its call in the ring is ignored
+  for (uint64_t i = first; i < nr_record; i ++) {
+    FtraceRecord *r = &ring[i % CONFIG_FTRACE_RING_SIZE];
+    if (r->kind == FTRACE_CALL) {
+      node[nr_node] = (Node) { .sym = r->sym, .pc = r->pc, .depth = sp, .start = r->nr_inst,
+        .outermost = (active[sym_idx(r->sym)] ++ == 0) };
+      stack[sp ++] = nr_node ++;
+    } else if (sp > 0) {
+      Node *n = &node[stack[-- sp]];
+      n->incl = r->nr_inst - n->start;
+      n->returned = true;
+      active[sym_idx(n->sym)] --;
+      if (sp > 0) node[stack[sp - 1]].child += n->incl;
+    }
+  }
+  // the calls which have not returned yet are still running
+  while (sp > 0) {
+    Node *n = &node[stack[-- sp]];
+    n->incl = g_nr_guest_inst - n->start;
+    if (sp > 0) node[stack[sp - 1]].child += n->incl;
+  }
+
+  fprintf(fp, "call tree of the last %d calls (inclusive / exclusive instructions):\n", nr_node);
+  for (int i = 0; i < nr_node; i ++) {
+    Node *n = &node[i];
+    fprintf(fp, "%*s", n->depth * 2, "");
+    print_name(fp, n->sym, n->pc);
+    fprintf(fp, "  %" PRIu64 " / %" PRIu64 "%s\n", n->incl, n->incl - n->child,
+        n->returned ? "" : " (running)");
+  }
+
+  uint64_t *incl = calloc(nr_sym + 1, sizeof(uint64_t));
+  uint64_t *calls = calloc(nr_sym + 1, sizeof(uint64_t));
+  excl_sum = calloc(nr_sym + 1, sizeof(uint64_t));
+  int *order = malloc(sizeof(int) * (nr_sym + 1));
+  for (int i = 0; i < nr_node; i ++) {
+    int id = sym_idx(node[i].sym);
+    // recursive calls are already in the inclusive count of the outermost one
+    if (node[i].outermost) incl[id] += node[i].incl;
+    excl_sum[id] += node[i].incl - node[i].child;
+    calls[id] ++;
+  }
+  int nr_order = 0;
+  for (int i = 0; i <= nr_sym; i ++) {
+    if (calls[i] > 0) order[nr_order ++] = i;
+  }
+  qsort(order, nr_order, sizeof(int), excl_cmp);
+
+  fprintf(fp, "%12s %12s %8s  function\n", "exclusive", "inclusive", "calls");
+  for (int i = 0; i < nr_order; i ++) {
+    int id = order[i];
+    fprintf(fp, "%12" PRIu64 " %12" PRIu64 " %8" PRIu64 "  %s\n", excl_sum[id], incl[id], calls[id],
+        id == nr_sym ? "???" : symbol_name(id));
+  }
+  fflush(fp);
+
+  free(incl);
+  free(calls);
+  free(excl_sum);
+  free(order);
+  free(active);
+  free(node);
+  free(stack);
+}
+#endif
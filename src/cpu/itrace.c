@@ -0,0 +1,98 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <cpu/itrace.h>
+
+#ifdef CONFIG_ITRACE
+
+void itrace_format(char *buf, int size, vaddr_t pc, uint8_t *inst, int ilen) {
+  char *p = buf;
+  p += snprintf(p, size, FMT_WORD ":", fmt_word(pc));
+  int i;
+  for (i = ilen - 1; i >= 0; i --) {
+    p += snprintf(p, 4, " %02x", inst[i]);
+  }
+  int ilen_max = MUXDEF(CONFIG_ISA_x86, 8, 4);
+  int space_len = ilen_max - ilen;
+  if (space_len < 0) space_len = 0;
+  space_len = space_len * 3 + 1;
+  memset(p, ' ', space_len);
+  p += space_len;
+
+#ifndef CONFIG_ISA_loongarch32r
+  void disassemble(char *str, int size, uint64_t pc, uint8_t *code, int nbyte);
+  disassemble(p, buf + size - p, MUXDEF(CONFIG_ISA_x86, pc + ilen, pc), inst, ilen);
+#else
+  p[0] = '\0'; // the upstream llvm does not support loongarch32r
+#endif
+}
+
+#ifdef CONFIG_ITRACE_BINARY
+// the number of records disassembled by itrace_dump()
+#define NR_DUMP 16
+
+ItraceRecord itrace_ring[CONFIG_ITRACE_RING_SIZE];
+uint64_t itrace_nr_record = 0;
+static uint64_t nr_written = 0;
+static FILE *fp = NULL;
+
+void init_itrace(const char *log_dir) {
+  if (log_dir == NULL) return;
+  char file[256];
+  int len = snprintf(file, sizeof(file), "%sitrace.bin", log_dir);
+  Assert(len < sizeof(file), "log file name %s is too long", file);
+  // called again by a forked child to write its own file
+  if (fp != NULL) fclose(fp);
+  else atexit(itrace_flush);
+  fp = fopen(file, "wb");
+  Assert(fp, "Can not open '%s'", file);
+  Log("binary instruction trace is written to %s", file);
+}
+
+static void write_records(uint64_t from, uint64_t to) {
+  // the ring only holds the last CONFIG_ITRACE_RING_SIZE records
+  if (to - from > CONFIG_ITRACE_RING_SIZE) from = to - CONFIG_ITRACE_RING_SIZE;
+  while (from < to) {
+    uint64_t idx = from % CONFIG_ITRACE_RING_SIZE;
+    uint64_t n = MIN(to - from, CONFIG_ITRACE_RING_SIZE - idx);
+    fwrite(&itrace_ring[idx], sizeof(ItraceRecord), n, fp);
+    from += n;
+  }
+  nr_written = to;
+}
+
+void itrace_write_block() {
+  if (fp != NULL) write_records(nr_written, itrace_nr_record);
+}
+
+void itrace_flush() {
+  itrace_write_block();
+  if (fp != NULL) fflush(fp);
+}
+
+void itrace_dump() {
+  uint64_t n = MIN(itrace_nr_record, NR_DUMP);
+  if (n == 0) return;
+  _Log(nemu, "last %" PRIu64 " instructions in the trace:\n", n);
+  for (uint64_t i = itrace_nr_record - n; i < itrace_nr_record; i ++) {
+    ItraceRecord *r = &itrace_ring[i % CONFIG_ITRACE_RING_SIZE];
+    char buf[128];
+    itrace_format(buf, sizeof(buf), r->pc, (uint8_t *)&r->inst, sizeof(r->inst));
+    _Log(nemu, "%s %s\n", (i == itrace_nr_record - 1 ? "-->" : "   "), buf);
+  }
+}
+#endif
+
+#endif
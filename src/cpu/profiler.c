@@ -0,0 +1,142 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <cpu/ftrace.h>
+#include <cpu/profiler.h>
+#include <device/event.h>
+
+#ifdef CONFIG_PROFILER
+// callers recorded with each sample
+#define DEPTH MUXDEF(CONFIG_FTRACE, CONFIG_PROFILER_DEPTH, 0)
+
+/* A frame is the ID of a function, or the pc itself with UNKNOWN_FRAME set
+ * when the sampled pc is not in any known function. */
+#define UNKNOWN_FRAME ((uint64_t)1 << 63)
+
+typedef struct {
+  uint64_t frame[DEPTH + 1]; // the outermost first, the sampled pc last
+  int nr_frame;
+  uint64_t count;
+} Sample;
+
+// distinct stacks in an open addressing hash table
+static Sample *table = NULL;
+static uint64_t table_size = 0;
+static uint64_t nr_entry = 0;
+static uint64_t nr_sample = 0;
+static char *profile_file = NULL;
+
+static uint64_t hash(const uint64_t *frame, int n) {
+  uint64_t h = n;
+  for (int i = 0; i < n; i ++) {
+    h = (h ^ frame[i]) * 0x9e3779b97f4a7c15ull;
+  }
+  return h ^ (h >> 32);
+}
+
+static Sample *find(const uint64_t *frame, int n) {
+  uint64_t mask = table_size - 1;
+  for (uint64_t i = hash(frame, n) & mask; ; i = (i + 1) & mask) {
+    Sample *e = &table[i];
+    if (e->count == 0 || (e->nr_frame == n && memcmp(e->frame, frame, sizeof(*frame) * n) == 0)) {
+      return e;
+    }
+  }
+}
+
+static void grow() {
+  Sample *old = table;
+  uint64_t old_size = table_size;
+  table_size = (table_size == 0 ? 4096 : table_size * 2);
+  table = calloc(table_size, sizeof(Sample));
+  assert(table != NULL);
+  for (uint64_t i = 0; i < old_size; i ++) {
+    if (old[i].count != 0) *find(old[i].frame, old[i].nr_frame) = old[i];
+  }
+  free(old);
+}
+
+static void sample() {
+  uint64_t frame[DEPTH + 1];
+  int n = 0;
+#if DEPTH > 0
+  // the innermost function on the stack is the one being sampled
+  int32_t caller[DEPTH + 1];
+  int nr_caller = ftrace_stack(caller, DEPTH + 1) - 1;
+  for (int i = 0; i < nr_caller; i ++) {
+    frame[n ++] = (caller[i] == -1 ? UNKNOWN_FRAME : caller[i]);
+  }
+#endif
+  int id = symbol_find(cpu.pc);
+  frame[n ++] = (id == -1 ? UNKNOWN_FRAME | cpu.pc : id);
+
+  if ((nr_entry + 1) * 2 > table_size) grow();
+  Sample *e = find(frame, n);
+  if (e->count == 0) {
+    memcpy(e->frame, frame, sizeof(*frame) * n);
+    e->nr_frame = n;
+    nr_entry ++;
+  }
+  e->count ++;
+  nr_sample ++;
+
+  add_event(CONFIG_PROFILER_PERIOD, sample);
+}
+
+static void print_frame(FILE *fp, uint64_t frame) {
+  if (!(frame & UNKNOWN_FRAME)) fprintf(fp, "%s", symbol_name(frame));
+  else if (frame == UNKNOWN_FRAME) fprintf(fp, "???");
+  else fprintf(fp, "0x%" PRIx64, frame & ~UNKNOWN_FRAME);
+}
+
+void profiler_dump(FILE *fp) {
+  for (uint64_t i = 0; i < table_size; i ++) {
+    Sample *e = &table[i];
+    if (e->count == 0) continue;
+    for (int j = 0; j < e->nr_frame; j ++) {
+      if (j > 0) fputc(';', fp);
+      print_frame(fp, e->frame[j]);
+    }
+    fprintf(fp, " %" PRIu64 "\n", e->count);
+  }
+}
+
+static void save_profile() {
+  FILE *fp = fopen(profile_file, "w");
+  Assert(fp, "Can not open '%s'", profile_file);
+  profiler_dump(fp);
+  fclose(fp);
+  Log("%" PRIu64 " samples of %" PRIu64 " distinct stacks are written to %s",
+      nr_sample, nr_entry, profile_file);
+}
+
+void init_profiler(const char *log_dir) {
+  // called again by a forked child to write its own file
+  static bool sampling = false;
+  if (!sampling) {
+    add_event(CONFIG_PROFILER_PERIOD, sample);
+    sampling = true;
+  }
+  if (log_dir == NULL) {
+    Log("No log directory is given, the profile is only printed by the `profile' command");
+    return;
+  }
+  if (profile_file == NULL) atexit(save_profile);
+  else free(profile_file);
+  profile_file = malloc(strlen(log_dir) + 16);
+  sprintf(profile_file, "%sprofile.folded", log_dir);
+}
+#endif
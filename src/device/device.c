@@ -16,6 +16,7 @@
 #include <common.h>
 #include <utils.h>
 #include <device/alarm.h>
+#include <device/event.h>
 #ifndef CONFIG_TARGET_AM
 #include <SDL2/SDL.h>
 #endif
@@ -33,10 +34,24 @@ void init_alarm();
 void send_key(uint8_t, bool);
 void vga_update_screen();
 
-void device_update() {
-  static uint64_t last = 0;
+#define FRAME_US (1000000 / TIMER_HZ)
+// bounds of the number of guest instructions between two polls of the host clock
+#define MIN_UPDATE_PERIOD 1024
+#define MAX_UPDATE_PERIOD (1 << 24)
+
+static void device_update() {
+  static uint64_t last = 0, last_poll = 0;
+  static uint64_t period = MIN_UPDATE_PERIOD;
   uint64_t now = get_time();
-  if (now - last < 1000000 / TIMER_HZ) {
+
+  // poll the host clock a few times per frame, however fast the guest runs
+  uint64_t elapsed = now - last_poll;
+  if (elapsed < FRAME_US / 8 && period < MAX_UPDATE_PERIOD) period *= 2;
+  else if (elapsed > FRAME_US / 2 && period > MIN_UPDATE_PERIOD) period /= 2;
+  last_poll = now;
+  add_event(period, device_update);
+
+  if (now - last < FRAME_US) {
     return;
   }
   last = now;
@@ -86,4 +101,6 @@ void init_device() {
   IFDEF(CONFIG_HAS_SDCARD, init_sdcard());
 
   IFNDEF(CONFIG_TARGET_AM, init_alarm());
+
+  add_event(MIN_UPDATE_PERIOD, device_update);
 }
@@ -0,0 +1,81 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <device/event.h>
+
+/* Events are kept in a min-heap ordered by their deadlines, so the cpu only
+ * has to compare the instruction count with the earliest one. A handler
+ * which should be called periodically adds itself again. */
+
+#define MAX_EVENT 16
+
+typedef struct {
+  uint64_t deadline;
+  event_handler_t handler;
+} Event;
+
+extern uint64_t g_nr_guest_inst;
+uint64_t g_event_deadline = UINT64_MAX;
+
+static Event heap[MAX_EVENT] = {};
+static int nr_event = 0;
+
+static void sift_up(int i) {
+  Event e = heap[i];
+  while (i > 0) {
+    int parent = (i - 1) / 2;
+    if (heap[parent].deadline <= e.deadline) break;
+    heap[i] = heap[parent];
+    i = parent;
+  }
+  heap[i] = e;
+}
+
+static void sift_down(int i) {
+  Event e = heap[i];
+  while (true) {
+    int child = i * 2 + 1;
+    if (child >= nr_event) break;
+    if (child + 1 < nr_event && heap[child + 1].deadline < heap[child].deadline) child ++;
+    if (e.deadline <= heap[child].deadline) break;
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = e;
+}
+
+void add_event(uint64_t delay, event_handler_t h) {
+  assert(nr_event < MAX_EVENT);
+  heap[nr_event] = (Event) { .deadline = g_nr_guest_inst + delay, .handler = h };
+  sift_up(nr_event ++);
+  g_event_deadline = heap[0].deadline;
+}
+
+void event_run() {
+  while (nr_event > 0 && heap[0].deadline <= g_nr_guest_inst) {
+    event_handler_t h = heap[0].handler;
+    heap[0] = heap[-- nr_event];
+    if (nr_event > 0) sift_down(0);
+    // the handler may add events
+    h();
+  }
+  g_event_deadline = (nr_event > 0 ? heap[0].deadline : UINT64_MAX);
+}
+
+void event_shift(int64_t delta) {
+  // the order of the heap is not changed
+  for (int i = 0; i < nr_event; i ++) heap[i].deadline += delta;
+  g_event_deadline = (nr_event > 0 ? heap[0].deadline : UINT64_MAX);
+}
@@ -32,6 +32,11 @@ uint8_t* new_space(int size) {
   return p;
 }
 
+uint8_t* io_space_used(size_t *size) {
+  *size = p_space - io_space;
+  return io_space;
+}
+
 static void check_bound(IOMap *map, paddr_t addr) {
   if (map == NULL) {
     Assert(map != NULL, "address (" FMT_PADDR ") is out of bound at pc = " FMT_WORD, fmt_paddr(addr), fmt_word(cpu.pc));
@@ -14,16 +14,82 @@
 ***************************************************************************************/
 
 #include <device/map.h>
+#include <memory/host.h>
 #include <memory/paddr.h>
+#include <memory/vaddr.h>
 
-#define NR_MAP 16
+#define NR_MAP 256
 
+// sorted by address
 static IOMap maps[NR_MAP] = {};
 static int nr_map = 0;
 
+/* The first map in each page, or NULL if there is no map in the page.
+ * Only the low 4GB of the address space is indexed by this two-level table,
+ * maps above it are found by binary search. */
+#define PT1_BITS 10
+#define PT2_BITS (32 - PAGE_SHIFT - PT1_BITS)
+static IOMap **page_table[1 << PT1_BITS] = {};
+
+static inline bool in_page_table(paddr_t addr) { return ((uint64_t)addr >> 32) == 0; }
+
+static IOMap **page_entry(paddr_t addr) {
+  IOMap **pt2 = page_table[addr >> (PAGE_SHIFT + PT2_BITS)];
+  return (pt2 == NULL ? NULL : &pt2[(addr >> PAGE_SHIFT) & ((1 << PT2_BITS) - 1)]);
+}
+
+static void build_page_table() {
+  for (int i = 0; i < (1 << PT1_BITS); i ++) {
+    if (page_table[i] != NULL) memset(page_table[i], 0, sizeof(IOMap *) << PT2_BITS);
+  }
+  // walk the maps in order, so that the first map of a page is set first
+  for (int i = 0; i < nr_map; i ++) {
+    for (uint64_t page = maps[i].low & ~PAGE_MASK; page <= maps[i].high; page += PAGE_SIZE) {
+      if (!in_page_table(page)) break;
+      IOMap ***pt2 = &page_table[page >> (PAGE_SHIFT + PT2_BITS)];
+      if (*pt2 == NULL) { *pt2 = calloc(1 << PT2_BITS, sizeof(IOMap *)); assert(*pt2); }
+      IOMap **entry = page_entry(page);
+      if (*entry == NULL) *entry = &maps[i];
+    }
+  }
+}
+
+// return the first map whose high end is not below `addr`
+static IOMap* search_map(paddr_t addr) {
+  int l = 0, r = nr_map;
+  while (l < r) {
+    int m = (l + r) / 2;
+    if (maps[m].high < addr) l = m + 1;
+    else r = m;
+  }
+  return (l < nr_map ? &maps[l] : NULL);
+}
+
+static IOMap* find_mmio_map(paddr_t addr) {
+  IOMap *map;
+  if (likely(in_page_table(addr))) {
+    IOMap **entry = page_entry(addr);
+    map = (entry == NULL ? NULL : *entry);
+  } else {
+    map = search_map(addr);
+  }
+  // maps sharing a page are next to each other
+  for (; map != NULL && map < maps + nr_map && map->low <= addr; map ++) {
+    if (addr <= map->high) return map;
+  }
+  return NULL;
+}
+
 static IOMap* fetch_mmio_map(paddr_t addr) {
-  int mapid = find_mapid_by_addr(maps, nr_map, addr);
-  return (mapid == -1 ? NULL : &maps[mapid]);
+  IOMap *map = find_mmio_map(addr);
+  if (map != NULL) difftest_skip_ref();
+  return map;
+}
+
+// a map without callback works like plain memory
+static inline uint8_t *direct_space(IOMap *map, paddr_t addr, int len) {
+  if (map == NULL || map->callback != NULL || addr + len - 1 > map->high) return NULL;
+  return (uint8_t *)map->space + (addr - map->low);
 }
 
 static void report_mmio_overlap(const char *name1, paddr_t l1, paddr_t r1,
@@ -46,19 +112,32 @@ void add_mmio_map(const char *name, paddr_t addr, void *space, uint32_t len, io_
     }
   }
 
-  maps[nr_map] = (IOMap){ .name = name, .low = addr, .high = addr + len - 1,
+  int i = nr_map;
+  for (; i > 0 && maps[i - 1].low > left; i --) maps[i] = maps[i - 1];
+  maps[i] = (IOMap){ .name = name, .low = addr, .high = addr + len - 1,
     .space = space, .callback = callback };
   Log("Add mmio map '%s' at [" FMT_PADDR ", " FMT_PADDR "]",
-      maps[nr_map].name, fmt_paddr(maps[nr_map].low), fmt_paddr(maps[nr_map].high));
+      maps[i].name, fmt_paddr(maps[i].low), fmt_paddr(maps[i].high));
 
   nr_map ++;
+  build_page_table();
 }
 
 /* bus interface */
 word_t mmio_read(paddr_t addr, int len) {
-  return map_read(addr, len, fetch_mmio_map(addr));
+  IOMap *map = fetch_mmio_map(addr);
+  uint8_t *host = direct_space(map, addr, len);
+  if (likely(host != NULL)) return host_read(host, len);
+  return map_read(addr, len, map);
 }
 
 void mmio_write(paddr_t addr, int len, word_t data) {
-  map_write(addr, len, data, fetch_mmio_map(addr));
+  IOMap *map = fetch_mmio_map(addr);
+  uint8_t *host = direct_space(map, addr, len);
+  if (likely(host != NULL)) { host_write(host, len, data); return; }
+  map_write(addr, len, data, map);
+}
+
+uint8_t *mmio_direct_space(paddr_t addr, int len) {
+  return direct_space(find_mmio_map(addr), addr, len);
 }
@@ -15,6 +15,7 @@
 
 #include <device/map.h>
 #include <utils.h>
+#include <monitor/snapshot.h>
 
 #define KEYDOWN_MASK 0x8000
 
@@ -97,4 +98,9 @@ void init_i8042() {
   add_mmio_map("keyboard", CONFIG_I8042_DATA_MMIO, i8042_data_port_base, 4, i8042_data_io_handler);
 #endif
   IFNDEF(CONFIG_TARGET_AM, init_keymap());
+#ifdef CONFIG_SNAPSHOT
+  snapshot_add("keyboard.queue", key_queue, sizeof(key_queue), NULL);
+  snapshot_add("keyboard.front", &key_f, sizeof(key_f), NULL);
+  snapshot_add("keyboard.rear", &key_r, sizeof(key_r), NULL);
+#endif
 }
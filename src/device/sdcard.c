@@ -14,6 +14,7 @@
 ***************************************************************************************/
 
 #include <device/map.h>
+#include <monitor/snapshot.h>
 #include "mmc.h"
 
 // http://www.files.e-shop.co.il/pdastore/Tech-mmc-samsung/SEC%20MMC%20SPEC%20ver09.pdf
@@ -48,6 +49,27 @@ static uint32_t addr = 0;
 static bool write_cmd = 0;
 static bool read_ext_csd = false;
 
+#ifdef CONFIG_SNAPSHOT
+static struct {
+  uint32_t blkcnt, addr;
+  long blk_addr, pos;
+  bool write_cmd, read_ext_csd;
+} state;
+
+static void sdcard_snapshot(bool is_save) {
+  if (is_save) {
+    state.blkcnt = blkcnt; state.addr = addr;
+    state.blk_addr = blk_addr; state.pos = (fp ? ftell(fp) : 0);
+    state.write_cmd = write_cmd; state.read_ext_csd = read_ext_csd;
+  } else {
+    blkcnt = state.blkcnt; addr = state.addr;
+    blk_addr = state.blk_addr;
+    if (fp) fseek(fp, state.pos, SEEK_SET);
+    write_cmd = state.write_cmd; read_ext_csd = state.read_ext_csd;
+  }
+}
+#endif
+
 static void prepare_rw(int is_write) {
   blk_addr = base[SDARG];
   addr = 0;
@@ -131,4 +153,5 @@ void init_sdcard() {
   const char *img = CONFIG_SDCARD_IMG_PATH;
   fp = fopen(img, "r+");
   if (fp == NULL) Log("Can not find sdcard image: %s", img);
+  IFDEF(CONFIG_SNAPSHOT, snapshot_add("sdcard", &state, sizeof(state), sdcard_snapshot));
 }
@@ -15,3 +15,7 @@
 
 INC_PATH += $(NEMU_HOME)/src/engine/$(ENGINE)
 DIRS-y += src/engine/$(ENGINE)
+
+# the host interface (engine_start(), hostcall) is shared with the interpreter
+DIRS-$(CONFIG_ENGINE_TCACHE) += src/engine/interpreter
+DIRS-$(CONFIG_ENGINE_JIT) += src/engine/interpreter
@@ -0,0 +1,44 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <memory/paddr.h>
+#include <memory/vaddr.h>
+#include "icache.h"
+
+#ifdef CONFIG_ICACHE
+
+vaddr_t icache_tag[ICACHE_SIZE] = { [0 ... ICACHE_SIZE - 1] = ICACHE_INVALID_PC };
+Decode icache[ICACHE_SIZE] = {};
+
+Decode *icache_fill(vaddr_t pc) {
+  // entries are indexed by guest pc, so only cache code fetched without translation
+  if (isa_mmu_check(pc, 4, MEM_TYPE_IFETCH) != MMU_DIRECT || !in_pmem(pc)) return NULL;
+
+  int idx = icache_idx(pc);
+  // tag the entry before the instruction runs, in case it modifies itself
+  icache_tag[idx] = pc;
+  paddr_set_code_page(pc);
+  return &icache[idx];
+}
+
+void code_cache_invalidate(paddr_t addr) {
+  paddr_t page = addr & ~PAGE_MASK;
+  for (paddr_t pc = page; pc < page + PAGE_SIZE; pc += 4) {
+    int idx = icache_idx(pc);
+    if ((icache_tag[idx] & ~PAGE_MASK) == page) icache_tag[idx] = ICACHE_INVALID_PC;
+  }
+}
+
+#endif
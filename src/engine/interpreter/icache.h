@@ -0,0 +1,42 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __ICACHE_H__
+#define __ICACHE_H__
+
+#include <cpu/decode.h>
+
+// the number of entries, must be a power of 2
+#define ICACHE_SIZE 4096
+// no instruction starts at an odd address
+#define ICACHE_INVALID_PC 1
+
+// the guest pc of each entry, ICACHE_INVALID_PC if the entry is empty
+extern vaddr_t icache_tag[];
+extern Decode icache[];
+
+static inline int icache_idx(vaddr_t pc) { return (pc >> 2) & (ICACHE_SIZE - 1); }
+
+// return the decoded instruction at `pc`, or NULL if it is not cached
+static inline Decode *icache_lookup(vaddr_t pc) {
+  int idx = icache_idx(pc);
+  return (likely(icache_tag[idx] == pc) ? &icache[idx] : NULL);
+}
+
+/* Claim the entry of `pc` for the instruction which is about to be decoded
+ * there. Return NULL if the instruction at `pc` can not be cached. */
+Decode *icache_fill(vaddr_t pc);
+
+#endif
@@ -0,0 +1,402 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <memory/paddr.h>
+#include <memory/vaddr.h>
+#include <sys/mman.h>
+#include <stddef.h>
+#include "jit.h"
+
+#ifndef __x86_64__
+#error "the JIT engine only generates x86-64 code"
+#endif
+
+#define CODE_CACHE_SIZE (32 * 1024 * 1024)
+#define NR_BLOCK (64 * 1024)
+#define NR_BUCKET 16384
+// enough for the code of any block
+#define BLOCK_MAX_SIZE (JIT_MAX_INST * 256 + 64)
+
+// an inline cache entry holding this never matches, since targets are aligned
+#define IC_INVALID_PC 1
+
+typedef struct {
+  int64_t budget;
+  JitExit *exit; // the exit to chain, or NULL
+} JitRet;
+
+uint8_t *jit_ptr = NULL;
+JitStat jit_stat = {};
+static uint8_t *code_cache = NULL;
+static uint8_t *code_start = NULL; // after the trampolines
+static JitRet (*jit_enter)(void *code, uint64_t budget) = NULL;
+static uint8_t *jit_leave = NULL;
+
+static JitBlock block[NR_BLOCK] = {};
+static int nr_block = 0;
+static uint64_t nr_flush = 0;
+static JitBlock *bucket[NR_BUCKET] = {};
+static JitBlock *page_list[CONFIG_MSIZE / PAGE_SIZE] = {};
+
+// the block being translated and its number of instructions so far
+static JitBlock *jit_block = NULL;
+static int jit_ninst = 0;
+// the pc of the instruction being translated
+static vaddr_t jit_pc = 0;
+static int jit_nexit = 0;
+// set when the code of some block is modified
+static bool code_changed = false;
+
+static inline int hash(vaddr_t pc) { return (pc >> 2) & (NR_BUCKET - 1); }
+static inline int page_idx(paddr_t addr) { return (addr - CONFIG_MBASE) >> PAGE_SHIFT; }
+
+#ifdef CONFIG_PMEM_GUARD
+// a guarded load, followed by the jump over its slow path
+#define GUARD_LOAD_SIZE 5
+#define JMP_SIZE 5
+
+// one bit for each byte of the code cache, set where a guarded load starts
+static uint8_t guard_load[CODE_CACHE_SIZE / 8] = {};
+
+static void mark_guard_load(uint8_t *p) {
+  size_t off = p - code_cache;
+  guard_load[off / 8] |= 1 << (off % 8);
+}
+
+// continue at the slow path of the load faulting at `pc`, or return 0 if
+// `pc` is not a guarded load
+static uintptr_t jit_fault(uintptr_t pc) {
+  if (pc < (uintptr_t)code_start || pc >= (uintptr_t)jit_ptr) return 0;
+  size_t off = pc - (uintptr_t)code_cache;
+  if (!(guard_load[off / 8] >> (off % 8) & 1)) return 0;
+  return pc + GUARD_LOAD_SIZE + JMP_SIZE;
+}
+#endif
+
+static void init_code_cache() {
+  code_cache = mmap(NULL, CODE_CACHE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  Assert(code_cache != MAP_FAILED, "failed to map the code cache");
+  jit_ptr = code_cache;
+
+  // JitRet jit_enter(void *code, uint64_t budget)
+  jit_enter = (void *)jit_ptr;
+  x86_push(RBX);
+  x86_push(R12);
+  x86_push(R13);
+  x86_push(R14);
+  x86_alu_ri(1, ALU_SUB, RSP, 8); // keep the stack 16-byte aligned for calls
+  x86_mov_ri(1, RBX, (uintptr_t)&cpu);
+  x86_mov_ri(1, R12, (uintptr_t)guest_to_host(CONFIG_MBASE));
+  x86_mov_ri(1, R13, (uintptr_t)pmem_code_page);
+  x86_mov_rr(1, R14, RSI);
+  x86_jmp_r(RDI);
+
+  // blocks jump here with the exit to chain in rdx
+  jit_leave = jit_ptr;
+  x86_mov_rr(1, RAX, R14);
+  x86_alu_ri(1, ALU_ADD, RSP, 8);
+  x86_pop(R14);
+  x86_pop(R13);
+  x86_pop(R12);
+  x86_pop(RBX);
+  x86_ret();
+
+  code_start = jit_ptr;
+  IFDEF(CONFIG_PMEM_GUARD, paddr_guard_fixup(jit_fault));
+}
+
+static void jit_flush() {
+  memset(bucket, 0, sizeof(bucket));
+  memset(page_list, 0, sizeof(page_list));
+  nr_block = 0;
+  nr_flush ++;
+  jit_ptr = code_start;
+  IFDEF(CONFIG_PMEM_GUARD, memset(guard_load, 0, sizeof(guard_load)));
+}
+
+JitBlock *jit_lookup(vaddr_t pc) {
+  for (JitBlock *jb = bucket[hash(pc)]; jb != NULL; jb = jb->hash_next) {
+    if (jb->pc == pc) return jb;
+  }
+  return NULL;
+}
+
+// store the pc and leave with `exit` in rdx
+static void emit_leave(vaddr_t pc, JitExit *exit) {
+  x86_mov_ri(JIT_W, RAX, pc);
+  x86_store(JIT_W, RBX, offsetof(CPU_state, pc), RAX);
+  x86_mov_ri(1, RDX, (uintptr_t)exit);
+  x86_patch(x86_jmp(), jit_leave);
+}
+
+JitBlock *jit_translate(vaddr_t pc) {
+  // blocks are indexed by guest pc, so only translate code fetched without translation
+  if (isa_mmu_check(pc, 4, MEM_TYPE_IFETCH) != MMU_DIRECT || !in_pmem(pc)) return NULL;
+  if (code_cache == NULL) init_code_cache();
+  if (nr_block == NR_BLOCK || jit_ptr + BLOCK_MAX_SIZE > code_cache + CODE_CACHE_SIZE) jit_flush();
+
+  JitBlock *jb = &block[nr_block ++];
+  jb->pc = pc;
+  jb->ic_victim = 0;
+  jb->chained = NULL;
+  for (int i = 0; i < JIT_MAX_EXIT; i ++) jb->exit[i].pprev = NULL;
+  jit_block = jb;
+  jit_nexit = 0;
+  paddr_set_code_page(pc);
+
+  // leave without running the block if there is not enough budget
+  uint8_t *no_budget = jit_ptr;
+  emit_leave(pc, NULL);
+  jb->code = jit_ptr;
+  x86_rr(1, 0x81, ALU_CMP, R14);
+  x86_dword(0);
+  uint8_t *ninst = jit_ptr - 4;
+  x86_patch(x86_jcc(CC_L), no_budget);
+
+  Decode s = { .snpc = pc };
+  int ret = JIT_NEXT;
+  for (jit_ninst = 0; ret == JIT_NEXT; ) {
+    s.pc = jit_pc = s.snpc;
+    // a block ends at a page boundary, so that it can be dropped with its page
+    if (jit_ninst == JIT_MAX_INST || ((s.pc ^ pc) & ~PAGE_MASK) != 0) break;
+    uint8_t *start = jit_ptr;
+    jit_ninst ++;
+    ret = isa_jit_translate(&s);
+    if (ret == JIT_FAIL) {
+      // leave it to the interpreter
+      jit_ptr = start;
+      jit_ninst --;
+    }
+  }
+  if (ret != JIT_END && jit_ninst > 0) jit_emit_exit(s.pc);
+  jb->ninst = jit_ninst;
+  memcpy(ninst, &jit_ninst, 4);
+  if (jit_ninst == 0) jit_ptr = no_budget;
+
+  int h = hash(pc);
+  jb->hash_next = bucket[h];
+  bucket[h] = jb;
+  int p = page_idx(pc);
+  jb->page_next = page_list[p];
+  page_list[p] = jb;
+  return jb;
+}
+
+static void chain(JitExit *e, JitBlock *to) {
+  jit_stat.nr_chain ++;
+  if (e->jmp != NULL) x86_patch(e->jmp, to->code);
+  else { e->pc = to->pc; e->code = to->code; }
+  e->next = to->chained;
+  if (e->next != NULL) e->next->pprev = &e->next;
+  e->pprev = &to->chained;
+  to->chained = e;
+}
+
+static void unchain(JitExit *e) {
+  if (e->pprev == NULL) return;
+  *e->pprev = e->next;
+  if (e->next != NULL) e->next->pprev = e->pprev;
+  e->pprev = NULL;
+  if (e->jmp != NULL) x86_patch(e->jmp, e->stub);
+  else e->pc = IC_INVALID_PC;
+}
+
+uint64_t jit_run(JitBlock *jb, uint64_t budget) {
+  jit_stat.nr_run ++;
+  JitRet ret = jit_enter(jb->code, budget);
+  JitExit *e = ret.exit;
+  if (e != NULL) {
+    // patch the exit to jump to the next block directly
+    uint64_t flush = nr_flush;
+    JitBlock *to = jit_lookup(cpu.pc);
+    if (to == NULL) to = jit_translate(cpu.pc);
+    if (to != NULL && to->ninst > 0 && nr_flush == flush) chain(e, to);
+  }
+  return budget - ret.budget;
+}
+
+// called by an indirect jump when its target is not in the inline cache
+static void *jit_ic_miss(JitBlock *jb, vaddr_t pc) {
+  jit_stat.nr_ic_miss ++;
+  // blocks can not be translated here, since that may flush the code cache
+  JitBlock *to = jit_lookup(pc);
+  if (to == NULL || to->ninst == 0) return NULL;
+  JitExit *e = &jb->exit[jb->ic_victim];
+  jb->ic_victim = (jb->ic_victim + 1) % JIT_IC_SIZE;
+  if (e->pprev != NULL) jit_stat.nr_ic_evict ++;
+  unchain(e);
+  chain(e, to);
+  return to->code;
+}
+
+void code_cache_invalidate(paddr_t addr) {
+  int p = page_idx(addr);
+  for (JitBlock *jb = page_list[p]; jb != NULL; jb = jb->page_next) {
+    JitBlock **pp = &bucket[hash(jb->pc)];
+    while (*pp != jb) pp = &(*pp)->hash_next;
+    *pp = jb->hash_next;
+    while (jb->chained != NULL) unchain(jb->chained);
+  }
+  page_list[p] = NULL;
+  code_changed = true;
+}
+
+static word_t jit_load(vaddr_t addr, int len) {
+  return vaddr_read(addr, len);
+}
+
+// return true if the block should be left
+static int jit_store(vaddr_t addr, int len, word_t data) {
+  code_changed = false;
+  vaddr_write(addr, len, data);
+  return code_changed || nemu_state.state != NEMU_RUNNING;
+}
+
+void jit_emit_call(const void *fn) {
+  x86_mov_ri(1, RAX, (uintptr_t)fn);
+  x86_call_r(RAX);
+}
+
+void jit_emit_exit(vaddr_t pc) {
+  Assert(jit_nexit < JIT_MAX_EXIT, "too many exits in a block");
+  JitExit *e = &jit_block->exit[jit_nexit ++];
+  if (jit_ninst > 0) x86_alu_ri(1, ALU_SUB, R14, jit_ninst);
+  e->jmp = x86_jmp();
+  e->stub = jit_ptr;
+  x86_patch(e->jmp, e->stub);
+  emit_leave(pc, e);
+}
+
+void jit_emit_exit_reg(int reg) {
+  Assert(jit_nexit == 0, "an indirect jump should be the only exit of a block");
+  x86_alu_ri(1, ALU_SUB, R14, jit_ninst);
+  x86_store(JIT_W, RBX, offsetof(CPU_state, pc), reg);
+  x86_mov_ri(1, RCX, (uintptr_t)jit_block->exit);
+  for (int i = 0; i < JIT_IC_SIZE; i ++) {
+    JitExit *e = &jit_block->exit[jit_nexit ++];
+    e->jmp = NULL;
+    e->pc = IC_INVALID_PC;
+    int32_t off = i * sizeof(JitExit);
+    x86_rm(JIT_W, 0x3b, reg, RCX, off + offsetof(JitExit, pc)); // cmp reg, e->pc
+    uint8_t *miss = x86_jcc(CC_NE);
+    x86_rm(0, 0xff, 4, RCX, off + offsetof(JitExit, code));   // jmp *e->code
+    x86_patch(miss, jit_ptr);
+  }
+  x86_mov_ri(1, RDI, (uintptr_t)jit_block);
+  x86_mov_rr(JIT_W, RSI, reg);
+  jit_emit_call(jit_ic_miss);
+  x86_alu_rr(1, ALU_OR, RAX, RAX);
+  uint8_t *leave = x86_jcc(CC_E);
+  x86_jmp_r(RAX);
+  x86_patch(leave, jit_ptr);
+  // the target is not translated yet
+  x86_mov_ri(1, RDX, 0);
+  x86_patch(x86_jmp(), jit_leave);
+}
+
+// cpu.pc = jit_pc, so that a slow path reports the pc of its instruction
+static void emit_set_pc() {
+  x86_mov_ri(JIT_W, RCX, jit_pc);
+  x86_store(JIT_W, RBX, offsetof(CPU_state, pc), RCX);
+}
+
+// rcx = rax - CONFIG_MBASE, the offset into pmem
+static void emit_pmem_offset() {
+  if (JIT_W) {
+    x86_mov_ri(1, RCX, -(uint64_t)CONFIG_MBASE);
+    x86_alu_rr(1, ALU_ADD, RCX, RAX);
+  } else {
+    x86_lea(0, RCX, RAX, -(uint32_t)CONFIG_MBASE);
+  }
+}
+
+void jit_emit_load(int len, bool sign) {
+  // fast path for pmem, everything else goes to vaddr_read()
+  emit_pmem_offset();
+#ifdef CONFIG_PMEM_GUARD
+  // a load outside pmem faults and continues at the slow path, see jit_fault()
+  uint8_t *load = jit_ptr;
+  if (len >= 4) x86_byte(0x3e); // a ds prefix makes all the loads the same size
+  uint8_t *slow = NULL;
+#else
+  x86_alu_ri(JIT_W, ALU_CMP, RCX, CONFIG_MSIZE - len);
+  uint8_t *slow = x86_jcc(CC_A);
+#endif
+  switch (len) {
+    case 1: x86_rmi(0, 0x0fb6, RAX, R12, RCX); break;
+    case 2: x86_rmi(0, 0x0fb7, RAX, R12, RCX); break;
+    case 4: x86_rmi(0, 0x8b, RAX, R12, RCX); break;
+    default: x86_rmi(1, 0x8b, RAX, R12, RCX); break;
+  }
+#ifdef CONFIG_PMEM_GUARD
+  assert(jit_ptr - load == GUARD_LOAD_SIZE);
+  mark_guard_load(load);
+#endif
+  uint8_t *done = x86_jmp();
+  if (slow != NULL) x86_patch(slow, jit_ptr);
+  emit_set_pc();
+  x86_mov_rr(JIT_W, RDI, RAX);
+  x86_mov_ri(0, RSI, len);
+  jit_emit_call(jit_load);
+  x86_patch(done, jit_ptr);
+
+  if (sign) {
+    switch (len) {
+      case 1: x86_movsx8(JIT_W, RAX, RAX); break;
+      case 2: x86_movsx16(JIT_W, RAX, RAX); break;
+      case 4: if (JIT_W) x86_movsx32(RAX, RAX); break;
+    }
+  }
+}
+
+void jit_emit_store(int len, vaddr_t npc) {
+  uint8_t *slow[3] = {}, *done = NULL;
+  if (!PMEM_WRITE_HOOKED) {
+    // fast path for pmem pages without cached code
+    emit_pmem_offset();
+    // with guard pages, the pages outside pmem are marked as having code
+    if (!ISDEF(CONFIG_PMEM_GUARD)) {
+      x86_alu_ri(JIT_W, ALU_CMP, RCX, CONFIG_MSIZE - len);
+      slow[0] = x86_jcc(CC_A);
+    }
+    for (int i = 0; i < (len > 1 ? 2 : 1); i ++) {
+      // check the pages of both the first and the last byte
+      x86_lea(0, RSI, RCX, i == 0 ? 0 : len - 1);
+      x86_shift_ri(0, SHIFT_SHR, RSI, PAGE_SHIFT);
+      x86_rmi(0, 0x80, ALU_CMP, R13, RSI);
+      x86_byte(0);
+      slow[i + 1] = x86_jcc(CC_NE);
+    }
+    if (len == 2) x86_byte(0x66);
+    x86_rmi(len == 8, len == 1 ? 0x88 : 0x89, RDX, R12, RCX);
+    done = x86_jmp();
+  }
+
+  for (int i = 0; i < ARRLEN(slow); i ++) {
+    if (slow[i] != NULL) x86_patch(slow[i], jit_ptr);
+  }
+  emit_set_pc();
+  x86_mov_rr(JIT_W, RDI, RAX);
+  x86_mov_ri(0, RSI, len);
+  jit_emit_call(jit_store);
+  x86_alu_rr(0, ALU_OR, RAX, RAX);
+  uint8_t *cont = x86_jcc(CC_E);
+  x86_alu_ri(1, ALU_SUB, R14, jit_ninst);
+  emit_leave(npc, NULL);
+  x86_patch(cont, jit_ptr);
+  if (done != NULL) x86_patch(done, jit_ptr);
+}
@@ -0,0 +1,104 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __JIT_H__
+#define __JIT_H__
+
+#include <cpu/decode.h>
+#include "x86-64.h"
+
+#if defined(CONFIG_DIFFTEST) || defined(CONFIG_WATCH_POINT)
+// these are checked after every instruction, so blocks are not chained either
+#define JIT_MAX_INST 1
+#define JIT_MAX_BUDGET 1
+#else
+#define JIT_MAX_INST 64
+// chained blocks return to the run loop after running this many instructions
+#define JIT_MAX_BUDGET 65536
+#endif
+
+// the two successors of a branch, or the inline cache of an indirect jump
+#define JIT_MAX_EXIT 2
+// an indirect jump compares its target with the last JIT_IC_SIZE ones
+#define JIT_IC_SIZE JIT_MAX_EXIT
+
+// operand size of a guest word
+#define JIT_W MUXDEF(CONFIG_ISA64, 1, 0)
+
+/* A jump out of a block. A direct jump is patched to go to the next block,
+ * an entry of the inline cache of an indirect jump holds its last targets.
+ * Either way, the exit is unchained when the next block is dropped. */
+typedef struct JitExit {
+  uint8_t *jmp;   // rel32 of a direct jump, or NULL for an inline cache entry
+  uint8_t *stub;  // where `jmp` goes when no block is chained
+  vaddr_t pc;     // guest pc of the inline cache entry
+  void *code;     // host code of the inline cache entry
+  struct JitExit *next, **pprev; // exits chained to the same block
+} JitExit;
+
+typedef struct JitBlock {
+  vaddr_t pc;
+  int ninst;  // 0 if the first instruction can not be translated
+  void *code;
+  JitExit exit[JIT_MAX_EXIT]; // direct jumps, or the inline cache
+  int ic_victim;    // the next inline cache entry to replace
+  JitExit *chained; // exits jumping to this block
+  struct JitBlock *hash_next;
+  struct JitBlock *page_next;
+} JitBlock;
+
+/* Counters of the dispatch between blocks. A hit in an inline cache is
+ * not counted, since it never leaves the generated code. */
+typedef struct {
+  uint64_t nr_run;      // calls of jit_run()
+  uint64_t nr_chain;    // exits patched to jump to a block
+  uint64_t nr_ic_miss;  // indirect jumps missing their inline cache
+  uint64_t nr_ic_evict; // inline cache entries replaced by a miss
+} JitStat;
+extern JitStat jit_stat;
+
+JitBlock *jit_lookup(vaddr_t pc);
+JitBlock *jit_translate(vaddr_t pc);
+/* run `jb` and the blocks chained to it, but no more than `budget`
+ * instructions, return the number of instructions executed */
+uint64_t jit_run(JitBlock *jb, uint64_t budget);
+
+/* Interface for the translator of the ISA.
+ *
+ * Generated code may use rax, rcx, rdx, rsi and rdi freely. These
+ * registers are pinned during the execution of a block:
+ *   rbx: &cpu
+ *   r12: host address of pmem
+ *   r13: pmem_code_page[]
+ *   r14: the number of instructions left to run
+ */
+enum { JIT_NEXT, JIT_END, JIT_FAIL };
+/* implemented by the ISA: translate the instruction at `s->pc` and advance
+ * `s->snpc`, return JIT_END if it leaves the block, or JIT_FAIL without
+ * emitting anything if it is not supported */
+int isa_jit_translate(Decode *s);
+
+// leave the block and continue at `pc`, at most JIT_MAX_EXIT times per block
+void jit_emit_exit(vaddr_t pc);
+// leave the block and continue at the address in `reg`, which is not rcx or rdx
+void jit_emit_exit_reg(int reg);
+// rax = M[rax], extended to a guest word
+void jit_emit_load(int len, bool sign);
+// M[rax] = rdx, leave the block at `npc` if the store modifies cached code
+void jit_emit_store(int len, vaddr_t npc);
+// call a C function with arguments in rdi, rsi and rdx
+void jit_emit_call(const void *fn);
+
+#endif
@@ -0,0 +1,154 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __X86_64_H__
+#define __X86_64_H__
+
+#include <common.h>
+
+// A tiny x86-64 encoder. Instructions are emitted at `jit_ptr`.
+// `w` selects the operand size: 0 for 32 bits, 1 for 64 bits.
+
+extern uint8_t *jit_ptr;
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+enum { CC_O, CC_NO, CC_B, CC_AE, CC_E, CC_NE, CC_BE, CC_A,
+       CC_S, CC_NS, CC_P, CC_NP, CC_L, CC_GE, CC_LE, CC_G };
+enum { ALU_ADD, ALU_OR, ALU_ADC, ALU_SBB, ALU_AND, ALU_SUB, ALU_XOR, ALU_CMP };
+enum { SHIFT_SHL = 4, SHIFT_SHR = 5, SHIFT_SAR = 7 };
+
+static inline void x86_byte(uint8_t b) { *jit_ptr ++ = b; }
+static inline void x86_dword(uint32_t d) { memcpy(jit_ptr, &d, 4); jit_ptr += 4; }
+static inline void x86_qword(uint64_t q) { memcpy(jit_ptr, &q, 8); jit_ptr += 8; }
+
+static inline void x86_rex(int w, int reg, int index, int base) {
+  uint8_t rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | ((index >> 3) << 1) | (base >> 3);
+  if (rex != 0x40) x86_byte(rex);
+}
+
+// two-byte opcodes are written as 0x0fxx
+static inline void x86_opcode(int op) {
+  if (op > 0xff) x86_byte(op >> 8);
+  x86_byte(op);
+}
+
+// op reg, rm
+static inline void x86_rr(int w, int op, int reg, int rm) {
+  x86_rex(w, reg, 0, rm);
+  x86_opcode(op);
+  x86_byte(0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// op reg, [base + disp]
+static inline void x86_rm(int w, int op, int reg, int base, int32_t disp) {
+  x86_rex(w, reg, 0, base);
+  x86_opcode(op);
+  int mod = (disp == 0 && (base & 7) != RBP) ? 0 : (disp == (int8_t)disp ? 1 : 2);
+  x86_byte((mod << 6) | ((reg & 7) << 3) | (base & 7));
+  if ((base & 7) == RSP) x86_byte(0x24);
+  if (mod == 1) x86_byte(disp);
+  else if (mod == 2) x86_dword(disp);
+}
+
+// op reg, [base + index]
+static inline void x86_rmi(int w, int op, int reg, int base, int index) {
+  x86_rex(w, reg, index, base);
+  x86_opcode(op);
+  int mod = ((base & 7) == RBP ? 1 : 0);
+  x86_byte((mod << 6) | ((reg & 7) << 3) | 4);
+  x86_byte(((index & 7) << 3) | (base & 7));
+  if (mod == 1) x86_byte(0);
+}
+
+static inline void x86_mov_rr(int w, int dst, int src) { x86_rr(w, 0x8b, dst, src); }
+static inline void x86_load(int w, int dst, int base, int32_t disp) { x86_rm(w, 0x8b, dst, base, disp); }
+static inline void x86_store(int w, int base, int32_t disp, int src) { x86_rm(w, 0x89, src, base, disp); }
+static inline void x86_lea(int w, int dst, int base, int32_t disp) { x86_rm(w, 0x8d, dst, base, disp); }
+
+static inline void x86_mov_ri(int w, int dst, uint64_t imm) {
+  if (!w || imm == (uint32_t)imm) {
+    // the upper 32 bits are cleared
+    x86_rex(0, 0, 0, dst);
+    x86_byte(0xb8 + (dst & 7));
+    x86_dword(imm);
+  } else if ((int64_t)imm == (int32_t)imm) {
+    x86_rr(1, 0xc7, 0, dst);
+    x86_dword(imm);
+  } else {
+    x86_rex(1, 0, 0, dst);
+    x86_byte(0xb8 + (dst & 7));
+    x86_qword(imm);
+  }
+}
+
+// always encoded with a 64-bit immediate, which can be patched later
+static inline void x86_movabs(int dst, uint64_t imm) {
+  x86_rex(1, 0, 0, dst);
+  x86_byte(0xb8 + (dst & 7));
+  x86_qword(imm);
+}
+
+static inline void x86_alu_rr(int w, int alu, int dst, int src) { x86_rr(w, alu * 8 + 3, dst, src); }
+
+static inline void x86_alu_ri(int w, int alu, int dst, int32_t imm) {
+  if (imm == (int8_t)imm) { x86_rr(w, 0x83, alu, dst); x86_byte(imm); }
+  else { x86_rr(w, 0x81, alu, dst); x86_dword(imm); }
+}
+
+static inline void x86_shift_ri(int w, int shift, int dst, int imm) { x86_rr(w, 0xc1, shift, dst); x86_byte(imm); }
+static inline void x86_shift_rcl(int w, int shift, int dst) { x86_rr(w, 0xd3, shift, dst); }
+
+// rdx:rax = rax * src
+static inline void x86_mul(int w, int src) { x86_rr(w, 0xf7, 4, src); }
+static inline void x86_imul1(int w, int src) { x86_rr(w, 0xf7, 5, src); }
+// dst = dst * src
+static inline void x86_imul(int w, int dst, int src) { x86_rr(w, 0x0faf, dst, src); }
+
+static inline void x86_movsx8(int w, int dst, int src) { x86_rr(w, 0x0fbe, dst, src); }
+static inline void x86_movsx16(int w, int dst, int src) { x86_rr(w, 0x0fbf, dst, src); }
+static inline void x86_movsx32(int dst, int src) { x86_rr(1, 0x63, dst, src); }
+
+// dst = (cc ? 1 : 0), `dst` should be one of rax, rcx, rdx and rbx
+static inline void x86_setcc(int cc, int dst) {
+  x86_rr(0, 0x0f90 + cc, 0, dst);
+  x86_rr(0, 0x0fb6, dst, dst);
+}
+
+static inline void x86_push(int r) { x86_rex(0, 0, 0, r); x86_byte(0x50 + (r & 7)); }
+static inline void x86_pop(int r) { x86_rex(0, 0, 0, r); x86_byte(0x58 + (r & 7)); }
+static inline void x86_ret() { x86_byte(0xc3); }
+static inline void x86_call_r(int r) { x86_rr(0, 0xff, 2, r); }
+static inline void x86_jmp_r(int r) { x86_rr(0, 0xff, 4, r); }
+
+// the jumps below return the address of their rel32 for x86_patch()
+static inline uint8_t *x86_jmp() {
+  x86_byte(0xe9);
+  x86_dword(0);
+  return jit_ptr - 4;
+}
+
+static inline uint8_t *x86_jcc(int cc) {
+  x86_byte(0x0f);
+  x86_byte(0x80 + cc);
+  x86_dword(0);
+  return jit_ptr - 4;
+}
+
+static inline void x86_patch(uint8_t *rel32, const void *target) {
+  int32_t rel = (const uint8_t *)target - (rel32 + 4);
+  memcpy(rel32, &rel, 4);
+}
+
+#endif
@@ -0,0 +1,90 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <memory/paddr.h>
+#include "tcache.h"
+
+#define TCACHE_SIZE (8 * 1024 * 1024)
+#define NR_BUCKET 4096
+#define TB_MAX_SIZE (sizeof(TBlock) + sizeof(Decode) * TB_MAX_INST)
+
+static uint8_t tcache[TCACHE_SIZE] PG_ALIGN = {};
+static uint8_t *tcache_top = tcache;
+static TBlock *bucket[NR_BUCKET] = {};
+static TBlock *page_list[CONFIG_MSIZE / PAGE_SIZE] = {};
+
+// the block being recorded is not visible to lookup until it is committed
+static TBlock *recording = NULL;
+static bool recording_stale = false;
+
+static inline int hash(vaddr_t pc) { return (pc >> 2) & (NR_BUCKET - 1); }
+static inline int page_idx(paddr_t addr) { return (addr - CONFIG_MBASE) >> PAGE_SHIFT; }
+
+static void tcache_flush() {
+  memset(bucket, 0, sizeof(bucket));
+  memset(page_list, 0, sizeof(page_list));
+  tcache_top = tcache;
+}
+
+TBlock *tcache_lookup(vaddr_t pc) {
+  for (TBlock *tb = bucket[hash(pc)]; tb != NULL; tb = tb->hash_next) {
+    if (tb->pc == pc) return tb;
+  }
+  return NULL;
+}
+
+TBlock *tcache_new(vaddr_t pc) {
+  // blocks are indexed by guest pc, so only cache code fetched without translation
+  if (isa_mmu_check(pc, 4, MEM_TYPE_IFETCH) != MMU_DIRECT || !in_pmem(pc)) return NULL;
+  if (tcache_top + TB_MAX_SIZE > tcache + TCACHE_SIZE) tcache_flush();
+
+  TBlock *tb = (TBlock *)tcache_top;
+  tb->pc = pc;
+  tb->ninst = 0;
+  tb->valid = true;
+  recording = tb;
+  recording_stale = false;
+  paddr_set_code_page(pc);
+  return tb;
+}
+
+void tcache_commit(TBlock *tb) {
+  assert(tb == recording);
+  recording = NULL;
+  // the code was modified while it was being recorded
+  if (recording_stale) return;
+
+  tcache_top += ROUNDUP(sizeof(TBlock) + sizeof(Decode) * tb->ninst, sizeof(void *));
+  int h = hash(tb->pc);
+  tb->hash_next = bucket[h];
+  bucket[h] = tb;
+  int p = page_idx(tb->pc);
+  tb->page_next = page_list[p];
+  page_list[p] = tb;
+}
+
+void code_cache_invalidate(paddr_t addr) {
+  int p = page_idx(addr);
+  if (recording != NULL && page_idx(recording->pc) == p) recording_stale = true;
+
+  for (TBlock *tb = page_list[p]; tb != NULL; tb = tb->page_next) {
+    tb->valid = false;
+    TBlock **pp = &bucket[hash(tb->pc)];
+    while (*pp != tb) pp = &(*pp)->hash_next;
+    *pp = tb->hash_next;
+  }
+  page_list[p] = NULL;
+}
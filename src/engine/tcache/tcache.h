@@ -0,0 +1,42 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __TCACHE_H__
+#define __TCACHE_H__
+
+#include <cpu/decode.h>
+#include <memory/vaddr.h>
+
+#define TB_MAX_INST 64
+
+typedef struct TBlock {
+  vaddr_t pc;
+  int ninst;
+  bool valid; // cleared when a store hits the code of this block
+  struct TBlock *hash_next;
+  struct TBlock *page_next;
+  Decode inst[];
+} TBlock;
+
+TBlock *tcache_lookup(vaddr_t pc);
+TBlock *tcache_new(vaddr_t pc);
+void tcache_commit(TBlock *tb);
+
+// a block ends at a page boundary, so that it can be dropped with its page
+static inline bool tb_is_full(TBlock *tb, vaddr_t next_pc) {
+  return tb->ninst == TB_MAX_INST || ((tb->pc ^ next_pc) & ~PAGE_MASK) != 0;
+}
+
+#endif
@@ -20,6 +20,7 @@ DIRS-BLACKLIST-$(CONFIG_TARGET_AM) += src/monitor/sdb
 
 SHARE = $(if $(CONFIG_TARGET_SHARE),1,0)
 LIBS += $(if $(CONFIG_TARGET_NATIVE_ELF),$(READLINE_PATH) -lreadline -ldl -pie,)
+LIBS += $(if $(CONFIG_DIFFTEST_LOCKSTEP)$(CONFIG_PMEM_MMAP),-lpthread,)
 
 ifdef mainargs
 ASFLAGS += -DBIN_PATH=\"$(mainargs)\"
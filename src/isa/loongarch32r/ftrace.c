@@ -0,0 +1,33 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <cpu/decode.h>
+
+#ifdef CONFIG_FTRACE
+int isa_ftrace_kind(Decode *s) {
+  uint32_t i = s->isa.inst.val;
+  int rd = BITS(i, 4, 0);
+  int rj = BITS(i, 9, 5);
+  switch (BITS(i, 31, 26)) {
+    case 0x15: return FTRACE_CALL; // bl
+    case 0x13: // jirl
+      if (rd == 1) return FTRACE_CALL;
+      if (rd == 0 && rj == 1) return FTRACE_RET;
+      return FTRACE_NONE;
+  }
+  return FTRACE_NONE;
+}
+#endif
@@ -41,7 +41,7 @@ static void decode_operand(Decode *s, int *rd_, word_t *src1, word_t *src2, word
   }
 }
 
-static int decode_exec(Decode *s) {
+static INSTPAT_FUNC int decode_exec(Decode *s) {
   int rd = 0;
   word_t src1 = 0, src2 = 0, imm = 0;
   s->dnpc = s->snpc;
@@ -50,6 +50,7 @@ static int decode_exec(Decode *s) {
 #define INSTPAT_MATCH(s, name, type, ... /* execute body */ ) { \
   decode_operand(s, &rd, &src1, &src2, &imm, concat(TYPE_, type)); \
   __VA_ARGS__ ; \
+  IFDEF(CONFIG_THREADED_DISPATCH, R(0) = 0; INSTPAT_DISPATCH(s)); \
 }
 
   INSTPAT_START();
@@ -67,6 +68,13 @@ static int decode_exec(Decode *s) {
 }
 
 int isa_exec_once(Decode *s) {
+  IFDEF(CONFIG_DECODE_CACHE, s->handler = NULL);
   s->isa.inst.val = inst_fetch(&s->snpc, 4);
   return decode_exec(s);
 }
+
+#ifdef CONFIG_DECODE_CACHE
+int isa_exec_decoded(Decode *s) {
+  return decode_exec(s);
+}
+#endif
@@ -0,0 +1,36 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <cpu/decode.h>
+
+#ifdef CONFIG_FTRACE
+int isa_ftrace_kind(Decode *s) {
+  uint32_t i = s->isa.inst.val;
+  int rs = BITS(i, 25, 21);
+  int rt = BITS(i, 20, 16);
+  switch (BITS(i, 31, 26)) {
+    case 0x03: return FTRACE_CALL; // jal
+    case 0x01: // bltzal, bgezal
+      return (rt == 0x10 || rt == 0x11) ? FTRACE_CALL : FTRACE_NONE;
+    case 0x00:
+      switch (BITS(i, 5, 0)) {
+        case 0x09: return FTRACE_CALL; // jalr
+        case 0x08: return rs == 31 ? FTRACE_RET : FTRACE_NONE; // jr $ra
+      }
+  }
+  return FTRACE_NONE;
+}
+#endif
@@ -0,0 +1,37 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <cpu/decode.h>
+
+#ifdef CONFIG_FTRACE
+// x1 and x5 are the link registers in the calling convention
+#define is_link(r) ((r) == 1 || (r) == 5)
+
+int isa_ftrace_kind(Decode *s) {
+  uint32_t i = s->isa.inst.val;
+  int rd = BITS(i, 11, 7);
+  int rs1 = BITS(i, 19, 15);
+  switch (BITS(i, 6, 0)) {
+    case 0x6f: // jal
+      return is_link(rd) ? FTRACE_CALL : FTRACE_NONE;
+    case 0x67: // jalr
+      if (is_link(rd)) return FTRACE_CALL;
+      if (rd == 0 && is_link(rs1)) return FTRACE_RET;
+      return FTRACE_NONE;
+  }
+  return FTRACE_NONE;
+}
+#endif
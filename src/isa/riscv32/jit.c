@@ -0,0 +1,155 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include "local-include/reg.h"
+#include <cpu/cpu.h>
+#include <cpu/ifetch.h>
+#include <cpu/decode.h>
+
+#ifdef CONFIG_ENGINE_JIT
+#include <jit.h>
+#include <stddef.h>
+
+/* Translate the instructions defined in decode_exec() of inst.c into
+ * x86-64, with the same patterns and semantics. Any other instruction is
+ * left to the interpreter, so that both engines run the same ISA. When an
+ * instruction is added to inst.c, its translation can be added here. */
+
+#define W JIT_W
+#define GPR(i) ((int32_t)offsetof(CPU_state, gpr[check_reg_idx(i)]))
+
+enum {
+  TYPE_I, TYPE_U, TYPE_S, TYPE_B, TYPE_J,
+  TYPE_N, // none
+};
+
+#define immI() do { *imm = SEXT(BITS(i, 31, 20), 12); } while(0)
+#define immU() do { *imm = SEXT(BITS(i, 31, 12), 20) << 12; } while(0)
+#define immS() do { *imm = (SEXT(BITS(i, 31, 25), 7) << 5) | BITS(i, 11, 7); } while(0)
+#define immB() do { *imm = (SEXT(BITS(i, 31, 31), 1) << 12) | (BITS(i, 7, 7) << 11) | \
+  (BITS(i, 30, 25) << 5) | (BITS(i, 11, 8) << 1); } while(0)
+#define immJ() do { *imm = (SEXT(BITS(i, 31, 31), 1) << 20) | (BITS(i, 19, 12) << 12) | \
+  (BITS(i, 20, 20) << 11) | (BITS(i, 30, 21) << 1); } while(0)
+
+static void decode_operand(Decode *s, int *rd, int *rs1, int *rs2, word_t *imm, int type) {
+  uint32_t i = s->isa.inst.val;
+  *rs1 = BITS(i, 19, 15);
+  *rs2 = BITS(i, 24, 20);
+  *rd  = BITS(i, 11, 7);
+  switch (type) {
+    case TYPE_I: immI(); break;
+    case TYPE_U: immU(); break;
+    case TYPE_S: immS(); break;
+    case TYPE_B: immB(); break;
+    case TYPE_J: immJ(); break;
+  }
+}
+
+// host <- R(r)
+static void ld(int host, int r) {
+  if (r == 0) x86_alu_rr(0, ALU_XOR, host, host);
+  else x86_load(W, host, RBX, GPR(r));
+}
+
+// R(r) <- host
+static void st(int r, int host) {
+  if (r == 0) return;
+  x86_store(W, RBX, GPR(r), host);
+}
+
+static void li(int rd, word_t imm) {
+  x86_mov_ri(W, RAX, imm);
+  st(rd, RAX);
+}
+
+static void alu_ri(int rd, int rs1, word_t imm, int alu) {
+  ld(RAX, rs1);
+  x86_alu_ri(W, alu, RAX, imm);
+  st(rd, RAX);
+}
+
+static void load(int rd, int rs1, word_t imm, int len, bool sign) {
+  ld(RAX, rs1);
+  x86_alu_ri(W, ALU_ADD, RAX, imm);
+  jit_emit_load(len, sign);
+  st(rd, RAX);
+}
+
+static void store(Decode *s, int rs1, int rs2, word_t imm, int len) {
+  ld(RAX, rs1);
+  x86_alu_ri(W, ALU_ADD, RAX, imm);
+  ld(RDX, rs2);
+  jit_emit_store(len, s->snpc);
+}
+
+static void branch(Decode *s, int rs1, int rs2, word_t imm, int cc) {
+  ld(RAX, rs1); ld(RCX, rs2);
+  x86_alu_rr(W, ALU_CMP, RAX, RCX);
+  uint8_t *taken = x86_jcc(cc);
+  jit_emit_exit(s->snpc);
+  x86_patch(taken, jit_ptr);
+  jit_emit_exit(s->pc + imm);
+}
+
+static void jal(Decode *s, int rd, word_t imm) {
+  li(rd, s->snpc);
+  jit_emit_exit(s->pc + imm);
+}
+
+static void jalr(Decode *s, int rd, int rs1, word_t imm) {
+  ld(RAX, rs1);
+  x86_alu_ri(W, ALU_ADD, RAX, imm);
+  x86_alu_ri(W, ALU_AND, RAX, ~1);
+  x86_mov_ri(W, RCX, s->snpc);
+  st(rd, RCX);
+  jit_emit_exit_reg(RAX);
+}
+
+static int jit_decode(Decode *s) {
+  int rd = 0, rs1 = 0, rs2 = 0;
+  word_t imm = 0;
+  int ret = JIT_NEXT;
+
+#define INSTPAT_INST(s) ((s)->isa.inst.val)
+#define INSTPAT_MATCH(s, name, type, ... /* translate body */ ) { \
+  decode_operand(s, &rd, &rs1, &rs2, &imm, concat(TYPE_, type)); \
+  __VA_ARGS__ ; \
+}
+
+  INSTPAT_START();
+  INSTPAT("??????? ????? ????? ??? ????? 00101 11", auipc  , U, li(rd, s->pc + imm));
+  INSTPAT("??????? ????? ????? ??? ????? 11011 11", jal    , J, jal(s, rd, imm); ret = JIT_END);
+  INSTPAT("??????? ????? ????? 000 ????? 11001 11", jalr   , I, jalr(s, rd, rs1, imm); ret = JIT_END);
+  INSTPAT("??????? ????? ????? 000 ????? 11000 11", beq    , B, branch(s, rs1, rs2, imm, CC_E); ret = JIT_END);
+  INSTPAT("??????? ????? ????? 001 ????? 11000 11", bne    , B, branch(s, rs1, rs2, imm, CC_NE); ret = JIT_END);
+  INSTPAT("??????? ????? ????? 100 ????? 11000 11", blt    , B, branch(s, rs1, rs2, imm, CC_L); ret = JIT_END);
+  INSTPAT("??????? ????? ????? 101 ????? 11000 11", bge    , B, branch(s, rs1, rs2, imm, CC_GE); ret = JIT_END);
+  INSTPAT("??????? ????? ????? 110 ????? 11000 11", bltu   , B, branch(s, rs1, rs2, imm, CC_B); ret = JIT_END);
+  INSTPAT("??????? ????? ????? 111 ????? 11000 11", bgeu   , B, branch(s, rs1, rs2, imm, CC_AE); ret = JIT_END);
+  INSTPAT("??????? ????? ????? 100 ????? 00000 11", lbu    , I, load(rd, rs1, imm, 1, false));
+  INSTPAT("??????? ????? ????? 000 ????? 01000 11", sb     , S, store(s, rs1, rs2, imm, 1));
+  INSTPAT("??????? ????? ????? 000 ????? 00100 11", addi   , I, alu_ri(rd, rs1, imm, ALU_ADD));
+
+  INSTPAT("??????? ????? ????? ??? ????? ????? ??", inv    , N, ret = JIT_FAIL);
+  INSTPAT_END();
+
+  return ret;
+}
+
+int isa_jit_translate(Decode *s) {
+  s->isa.inst.val = inst_fetch(&s->snpc, 4);
+  return jit_decode(s);
+}
+#endif
@@ -13,12 +13,20 @@
 * See the Mulan PSL v2 for more details.
 ***************************************************************************************/
 
+// for REG_RIP used by the handler of the guard pages
+#define _GNU_SOURCE
 #include <memory/host.h>
 #include <memory/paddr.h>
+#include <memory/vaddr.h>
 #include <device/mmio.h>
 #include <isa.h>
+#include <cpu/difftest.h>
+#ifndef CONFIG_TARGET_AM
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
-#if   defined(CONFIG_PMEM_MALLOC)
+#if   defined(CONFIG_PMEM_MALLOC) || defined(CONFIG_PMEM_MMAP)
 static uint8_t *pmem = NULL;
 #else // CONFIG_PMEM_GARRAY
 static uint8_t pmem[CONFIG_MSIZE] PG_ALIGN = {};
@@ -30,13 +38,244 @@ static bool oob_happen = false;
 uint8_t* guest_to_host(paddr_t paddr) { return pmem + (paddr - CONFIG_MBASE); }
 paddr_t host_to_guest(uint8_t *haddr) { return haddr - pmem + CONFIG_MBASE; }
 
+#ifdef CONFIG_PMEM_GUARD
+#ifndef __x86_64__
+#error "guard pages of pmem are only supported on x86-64 hosts"
+#endif
+#ifdef PMEM64
+#error "guard pages of pmem need a 32-bit physical address space"
+#endif
+#include <signal.h>
+#include <ucontext.h>
+
+/* pmem is at the start of a region reserved for the whole 32-bit physical
+ * address space, and the rest of the region is not accessible, so any
+ * paddr can be accessed at guest_to_host(paddr) without checking it. A
+ * guarded access is an inline asm whose address is recorded in the section
+ * `nemu_guard` together with where to continue if it faults. The fault
+ * handler then resumes there, which goes to mmio or out_of_bound(). The
+ * extra page at the end catches an access crossing the top of the space. */
+typedef struct {
+  int32_t insn, fixup; // relative to the field itself
+} GuardEntry;
+
+extern const GuardEntry __start_nemu_guard[], __stop_nemu_guard[];
+static uintptr_t (*guard_fixup)(uintptr_t pc) = NULL;
+
+#define GUARD_ASM(insn) \
+  "1: " insn "\n" \
+  ".pushsection nemu_guard, \"a\"\n" \
+  ".balign 4\n" \
+  ".long 1b - ., %l[fault] - .\n" \
+  ".popsection"
+
+static inline bool guard_read(paddr_t addr, int len, word_t *data) {
+  uint8_t *host = guest_to_host(addr);
+  word_t ret;
+  switch (len) {
+    case 1: asm goto (GUARD_ASM("movzbl (%1), %0") : "=r"(ret) : "r"(host) : : fault); break;
+    case 2: asm goto (GUARD_ASM("movzwl (%1), %0") : "=r"(ret) : "r"(host) : : fault); break;
+    default: asm goto (GUARD_ASM("movl (%1), %0") : "=r"(ret) : "r"(host) : : fault); break;
+  }
+  *data = ret;
+  return true;
+fault:
+  return false;
+}
+
+static inline bool guard_write(paddr_t addr, int len, word_t data) {
+  uint8_t *host = guest_to_host(addr);
+  switch (len) {
+    case 1: asm goto (GUARD_ASM("movb %b1, (%0)") : : "r"(host), "r"(data) : "memory" : fault); break;
+    case 2: asm goto (GUARD_ASM("movw %w1, (%0)") : : "r"(host), "r"(data) : "memory" : fault); break;
+    default: asm goto (GUARD_ASM("movl %1, (%0)") : : "r"(host), "r"(data) : "memory" : fault); break;
+  }
+  return true;
+fault:
+  return false;
+}
+
+static void guard_handler(int sig, siginfo_t *info, void *ucontext) {
+  greg_t *pc = &((ucontext_t *)ucontext)->uc_mcontext.gregs[REG_RIP];
+  uint8_t *addr = info->si_addr;
+  if (addr >= pmem && addr < pmem + GUARD_SIZE + PAGE_SIZE) {
+    for (const GuardEntry *e = __start_nemu_guard; e < __stop_nemu_guard; e ++) {
+      if ((uintptr_t)&e->insn + e->insn == *pc) {
+        *pc = (uintptr_t)&e->fixup + e->fixup;
+        return;
+      }
+    }
+    uintptr_t fixup = (guard_fixup ? guard_fixup(*pc) : 0);
+    if (fixup != 0) {
+      *pc = fixup;
+      return;
+    }
+  }
+  // a real segmentation fault, which happens again with the default action
+  signal(SIGSEGV, SIG_DFL);
+}
+
+void paddr_guard_fixup(uintptr_t (*fixup)(uintptr_t pc)) {
+  guard_fixup = fixup;
+}
+
+static void init_guard() {
+  uint8_t *region = mmap(NULL, GUARD_SIZE + PAGE_SIZE, PROT_NONE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  Assert(region != MAP_FAILED, "Can not reserve the address space for pmem");
+  pmem = mmap(region, CONFIG_MSIZE, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+  Assert(pmem != MAP_FAILED, "Can not map pmem");
+
+  struct sigaction s;
+  memset(&s, 0, sizeof(s));
+  s.sa_sigaction = guard_handler;
+  s.sa_flags = SA_SIGINFO;
+  int ret = sigaction(SIGSEGV, &s, NULL);
+  Assert(ret == 0, "Can not set signal handler");
+}
+#endif
+
+#ifndef CONFIG_PMEM_GUARD
 static word_t pmem_read(paddr_t addr, int len) {
   word_t ret = host_read(guest_to_host(addr), len);
   return ret;
 }
+#endif
+
+#ifdef CONFIG_PMEM_HASH
+/* The hash of a page is the sum of each byte multiplied by a key chosen by
+ * its offset, so that a store only adds the change of its bytes. A page is
+ * hashed from scratch when it is asked for after paddr_invalidate(). */
+static uint64_t pmem_hash[PMEM_NR_PAGE] = {};
+static bool pmem_hash_valid[PMEM_NR_PAGE] = {};
+
+static inline uint64_t hash_key(uint32_t offset) {
+  uint64_t x = (offset + 1) * 0x9e3779b97f4a7c15ull;
+  return (x ^ (x >> 31)) | 1;
+}
+
+static void hash_update(paddr_t addr, int len, word_t data) {
+  uint8_t *old = guest_to_host(addr);
+  for (int i = 0; i < len; i ++) {
+    int idx = (addr + i - CONFIG_MBASE) >> PAGE_SHIFT;
+    if (!pmem_hash_valid[idx]) continue;
+    int diff = (uint8_t)(data >> (i * 8)) - old[i];
+    pmem_hash[idx] += (uint64_t)diff * hash_key((addr + i) & PAGE_MASK);
+  }
+}
+
+static void hash_invalidate(paddr_t addr, size_t n) {
+  int last = (addr + n - 1 - CONFIG_MBASE) >> PAGE_SHIFT;
+  for (int idx = (addr - CONFIG_MBASE) >> PAGE_SHIFT; idx <= last; idx ++) {
+    pmem_hash_valid[idx] = false;
+  }
+}
+
+const uint64_t *paddr_hash() {
+  for (int idx = 0; idx < PMEM_NR_PAGE; idx ++) {
+    if (pmem_hash_valid[idx]) continue;
+    uint8_t *p = pmem + ((size_t)idx << PAGE_SHIFT);
+    uint64_t h = 0;
+    for (int i = 0; i < PAGE_SIZE; i ++) h += p[i] * hash_key(i);
+    pmem_hash[idx] = h;
+    pmem_hash_valid[idx] = true;
+  }
+  return pmem_hash;
+}
+#endif
+
+#ifdef CONFIG_CODE_CACHE
+// with guard pages, there is a flag for every page of the 32-bit physical
+// address space, and the ones outside pmem are always set
+bool pmem_code_page[MUXDEF(CONFIG_PMEM_GUARD, GUARD_SIZE, CONFIG_MSIZE) / PAGE_SIZE] = {};
+
+void paddr_set_code_page(paddr_t addr) {
+  int idx = (addr - CONFIG_MBASE) >> PAGE_SHIFT;
+  if (!pmem_code_page[idx]) {
+    pmem_code_page[idx] = true;
+    vaddr_flush_tlb_write(addr);
+  }
+}
+
+static void check_code_page(paddr_t addr) {
+  int idx = (addr - CONFIG_MBASE) >> PAGE_SHIFT;
+  if (unlikely(pmem_code_page[idx])) {
+    pmem_code_page[idx] = false;
+    code_cache_invalidate(addr);
+  }
+}
+#endif
+
+void paddr_invalidate(paddr_t addr, size_t n) {
+  IFDEF(CONFIG_PMEM_HASH, hash_invalidate(addr, n));
+#ifdef CONFIG_CODE_CACHE
+  size_t nr_page = ((addr & PAGE_MASK) + n + PAGE_SIZE - 1) >> PAGE_SHIFT;
+  for (size_t i = 0; i < nr_page; i ++) {
+    check_code_page((addr & ~PAGE_MASK) + (i << PAGE_SHIFT));
+  }
+#endif
+}
+
+#ifdef CONFIG_DIFFTEST_BATCH
+/* A page is saved at its first write after paddr_undo_begin(), which is
+ * told by the epoch it was last saved in. */
+static uint32_t undo_epoch[CONFIG_MSIZE / PAGE_SIZE] = {};
+static uint32_t cur_epoch = 1;
+static struct {
+  paddr_t page;
+  uint8_t data[PAGE_SIZE];
+} *undo_log = NULL;
+static int nr_undo = 0, max_undo = 0;
+
+static void undo_save(paddr_t addr) {
+  int idx = (addr - CONFIG_MBASE) >> PAGE_SHIFT;
+  if (likely(undo_epoch[idx] == cur_epoch)) return;
+  undo_epoch[idx] = cur_epoch;
+  if (nr_undo == max_undo) {
+    max_undo = (max_undo == 0 ? 16 : max_undo * 2);
+    undo_log = realloc(undo_log, sizeof(undo_log[0]) * max_undo);
+    assert(undo_log);
+  }
+  paddr_t page = addr & ~PAGE_MASK;
+  undo_log[nr_undo].page = page;
+  memcpy(undo_log[nr_undo].data, guest_to_host(page), PAGE_SIZE);
+  nr_undo ++;
+}
+
+void paddr_undo_begin() {
+  nr_undo = 0;
+  if (++ cur_epoch == 0) {
+    memset(undo_epoch, 0, sizeof(undo_epoch));
+    cur_epoch = 1;
+  }
+}
+
+void paddr_undo(void (*fn)(paddr_t page)) {
+  for (int i = 0; i < nr_undo; i ++) {
+    paddr_t page = undo_log[i].page;
+    memcpy(guest_to_host(page), undo_log[i].data, PAGE_SIZE);
+    paddr_invalidate(page, PAGE_SIZE);
+    fn(page);
+  }
+  paddr_undo_begin();
+}
+#endif
 
 static void pmem_write(paddr_t addr, int len, word_t data) {
+#ifdef CONFIG_DIFFTEST_BATCH
+  undo_save(addr);
+  undo_save(addr + len - 1);
+#endif
+  IFDEF(CONFIG_PMEM_HASH, hash_update(addr, len, data));
   host_write(guest_to_host(addr), len, data);
+  IFDEF(CONFIG_DIFFTEST_LOCKSTEP, difftest_commit_store(addr, len, data));
+#ifdef CONFIG_CODE_CACHE
+  check_code_page(addr);
+  if (unlikely(((addr ^ (addr + len - 1)) & ~PAGE_MASK) != 0)) {
+    check_code_page(addr + len - 1);
+  }
+#endif
 }
 
 void not_exit_on_oob() {
@@ -63,24 +302,186 @@ static void out_of_bound(paddr_t addr) {
   }
 }
 
+#if defined(CONFIG_PMEM_MMAP) && defined(CONFIG_MEM_RANDOM)
+#define PMEM_LAZY_RANDOM
+#include <linux/userfaultfd.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <pthread.h>
+
+// only in the headers of Linux 5.11 and later
+#ifndef UFFD_USER_MODE_ONLY
+#define UFFD_USER_MODE_ONLY 1
+#endif
+
+/* A page of pmem is filled with random values when it is touched for the
+ * first time. Its faults are sent to a userfaultfd, which a thread serves
+ * by copying a page of random values into it. Only faults from user mode
+ * are sent where the kernel supports it, which does not need privileges,
+ * so pmem is touched by paddr_touch() before the kernel writes into it. */
+static uint8_t *random_page = NULL;
+static long host_page_size = 0;
+static int lazy_uffd = -1;
+// pages mapped from a file by paddr_map(), which can not be registered
+static bool pmem_mapped_page[CONFIG_MSIZE / PAGE_SIZE] = {};
+
+static void *fill_random_page(void *arg) {
+  int uffd = (intptr_t)arg;
+  struct uffd_msg msg;
+  while (read(uffd, &msg, sizeof(msg)) == sizeof(msg)) {
+    if (msg.event != UFFD_EVENT_PAGEFAULT) continue;
+    struct uffdio_copy copy = {
+      .dst = msg.arg.pagefault.address & ~(host_page_size - 1),
+      .src = (uintptr_t)random_page,
+      .len = host_page_size,
+    };
+    // fails with EEXIST if the page has been filled by another fault
+    ioctl(uffd, UFFDIO_COPY, &copy);
+  }
+  return NULL;
+}
+
+// register the anonymous pages of pmem to a new userfaultfd and serve it
+static bool start_lazy_random() {
+  int uffd = syscall(SYS_userfaultfd, O_CLOEXEC | UFFD_USER_MODE_ONLY);
+  // the kernel may be too old to know the flag
+  if (uffd < 0) uffd = syscall(SYS_userfaultfd, O_CLOEXEC);
+  if (uffd < 0) return false;
+  struct uffdio_api api = { .api = UFFD_API };
+  bool ok = ioctl(uffd, UFFDIO_API, &api) == 0;
+  const size_t nr_page = CONFIG_MSIZE / PAGE_SIZE;
+  for (size_t i = 0, j; ok && i < nr_page; i = j) {
+    for (j = i; j < nr_page && pmem_mapped_page[j] == pmem_mapped_page[i]; j ++);
+    if (pmem_mapped_page[i]) continue;
+    struct uffdio_register reg = {
+      .range = { .start = (uintptr_t)pmem + i * PAGE_SIZE, .len = (j - i) * PAGE_SIZE },
+      .mode = UFFDIO_REGISTER_MODE_MISSING,
+    };
+    ok = ioctl(uffd, UFFDIO_REGISTER, &reg) == 0;
+  }
+  if (!ok) {
+    close(uffd);
+    return false;
+  }
+  pthread_t thread;
+  int ret = pthread_create(&thread, NULL, fill_random_page, (void *)(intptr_t)uffd);
+  Assert(ret == 0, "Can not create the thread filling pmem");
+  pthread_detach(thread);
+  lazy_uffd = uffd;
+  return true;
+}
+
+static bool init_lazy_random(uint8_t val) {
+  host_page_size = sysconf(_SC_PAGESIZE);
+  random_page = aligned_alloc(host_page_size, host_page_size);
+  assert(random_page);
+  memset(random_page, val, host_page_size);
+  return start_lazy_random();
+}
+#endif
+
+#ifndef CONFIG_TARGET_AM
+bool paddr_map(paddr_t addr, size_t size, int fd, size_t offset) {
+  uintptr_t host = (uintptr_t)guest_to_host(addr);
+  long page = sysconf(_SC_PAGESIZE);
+  if ((host | size | offset) & (page - 1)) return false;
+  void *p = mmap((void *)host, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, offset);
+  if (p == MAP_FAILED) return false;
+#ifdef PMEM_LAZY_RANDOM
+  memset(pmem_mapped_page + (addr - PMEM_LEFT) / PAGE_SIZE, true, size / PAGE_SIZE);
+#endif
+  return true;
+}
+
+void paddr_touch(paddr_t addr, size_t n) {
+#ifdef PMEM_LAZY_RANDOM
+  if (lazy_uffd < 0 || n == 0) return;
+  uintptr_t host = (uintptr_t)guest_to_host(addr);
+  uintptr_t end = host + n;
+  for (host &= ~(host_page_size - 1); host < end; host += host_page_size) {
+    (void)*(volatile uint8_t *)host;
+  }
+#endif
+}
+
+void init_mem_fork() {
+#ifdef PMEM_LAZY_RANDOM
+  // a child inherits neither the registration nor the thread serving it
+  if (lazy_uffd < 0) return;
+  close(lazy_uffd);
+  lazy_uffd = -1;
+  bool ok = start_lazy_random();
+  Assert(ok, "Can not fill the untouched pages of pmem in the fork");
+#endif
+}
+#endif
+
+#ifdef CONFIG_SNAPSHOT
+void paddr_map_file(int fd, size_t offset) {
+  if (!paddr_map(PMEM_LEFT, CONFIG_MSIZE, fd, offset)) {
+    Log("can not map pmem from the snapshot, read it instead");
+    paddr_touch(PMEM_LEFT, CONFIG_MSIZE);
+    size_t n = pread(fd, pmem, CONFIG_MSIZE, offset);
+    Assert(n == CONFIG_MSIZE, "can not read pmem from the snapshot");
+  }
+  paddr_invalidate(PMEM_LEFT, CONFIG_MSIZE);
+  vaddr_flush_tlb();
+}
+#endif
+
 void init_mem() {
 #if   defined(CONFIG_PMEM_MALLOC)
-  pmem = malloc(CONFIG_MSIZE);
+  // page aligned, so that it can be mapped from a snapshot
+  pmem = aligned_alloc(PAGE_SIZE, CONFIG_MSIZE);
   assert(pmem);
+#elif defined(CONFIG_PMEM_GUARD)
+  init_guard();
+  IFDEF(CONFIG_CODE_CACHE, memset(pmem_code_page + CONFIG_MSIZE / PAGE_SIZE, true,
+        (GUARD_SIZE - CONFIG_MSIZE) / PAGE_SIZE));
+#elif defined(CONFIG_PMEM_MMAP)
+  // no memory is allocated by the host until a page is touched
+  pmem = mmap(NULL, CONFIG_MSIZE, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  Assert(pmem != MAP_FAILED, "Can not map pmem");
+#endif
+#ifdef CONFIG_MEM_RANDOM
+  uint8_t val = rand();
+#ifdef CONFIG_PMEM_MMAP
+  if (!init_lazy_random(val)) {
+    Log("userfaultfd is not available, fill pmem with random values now");
+    memset(pmem, val, CONFIG_MSIZE);
+  }
+#else
+  memset(pmem, val, CONFIG_MSIZE);
+#endif
 #endif
-  IFDEF(CONFIG_MEM_RANDOM, memset(pmem, rand(), CONFIG_MSIZE));
   Log("physical memory area [" FMT_PADDR ", " FMT_PADDR "]", 
     fmt_paddr(PMEM_LEFT), fmt_paddr(PMEM_RIGHT));
 }
 
 word_t paddr_read(paddr_t addr, int len) {
+#ifdef CONFIG_PMEM_GUARD
+  word_t data;
+  if (likely(guard_read(addr, len, &data))) return data;
+  // an access crossing the end of pmem
+  if (in_pmem(addr)) { out_of_bound(addr + len - 1); return 0; }
+#else
   if (likely(in_pmem(addr))) return pmem_read(addr, len);
+#endif
   IFDEF(CONFIG_DEVICE, return mmio_read(addr, len));
   out_of_bound(addr);
   return 0;
 }
 
 void paddr_write(paddr_t addr, int len, word_t data) {
+#if defined(CONFIG_PMEM_GUARD) && !defined(CONFIG_CODE_CACHE)
+  // a store with hooks still has to be checked
+  if (!PMEM_WRITE_HOOKED) {
+    if (likely(guard_write(addr, len, data))) return;
+    if (in_pmem(addr)) { out_of_bound(addr + len - 1); return; }
+  }
+#endif
   if (likely(in_pmem(addr))) { pmem_write(addr, len, data); return; }
   IFDEF(CONFIG_DEVICE, mmio_write(addr, len, data); return);
   out_of_bound(addr);
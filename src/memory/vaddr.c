@@ -14,16 +14,104 @@
 ***************************************************************************************/
 
 #include <isa.h>
+#include <memory/host.h>
 #include <memory/paddr.h>
+#include <memory/vaddr.h>
+#include <device/mmio.h>
 
+// the number of entries for each type of access, must be a power of 2
+#define NR_TLB 256
+// no page starts at an odd address
+#define TLB_INVALID_PAGE 1
+
+/* A software TLB caching the translation from a guest virtual page to
+ * host memory, with one direct-mapped table for each type of access.
+ * Only pages of pmem and MMIO pages working like plain memory are cached,
+ * so a hit does not walk the page table and never goes through paddr_read()
+ * or paddr_write(). */
+typedef struct {
+  vaddr_t page;     // guest virtual page, TLB_INVALID_PAGE if the entry is empty
+  uintptr_t addend; // host address = guest virtual address + addend
+} TLBEntry;
+
+#define TLB_INIT { [0 ... NR_TLB - 1] = { .page = TLB_INVALID_PAGE } }
+static TLBEntry tlb[3][NR_TLB] = { TLB_INIT, TLB_INIT, TLB_INIT };
+
+static inline TLBEntry *tlb_entry(int type, vaddr_t addr) {
+  return &tlb[type][(addr >> PAGE_SHIFT) & (NR_TLB - 1)];
+}
+
+// return the host address of `addr`, or NULL on a miss
+static inline uint8_t *tlb_lookup(int type, vaddr_t addr, int len) {
+  TLBEntry *e = tlb_entry(type, addr);
+  if (likely(e->page == (addr & ~PAGE_MASK) && (addr & PAGE_MASK) <= PAGE_SIZE - len)) {
+    return (uint8_t *)(addr + e->addend);
+  }
+  return NULL;
+}
+
+void vaddr_flush_tlb() {
+  for (int type = 0; type < 3; type ++) {
+    for (int i = 0; i < NR_TLB; i ++) tlb[type][i].page = TLB_INVALID_PAGE;
+  }
+}
+
+void vaddr_flush_tlb_write(paddr_t addr) {
+  uintptr_t host = (uintptr_t)guest_to_host(addr & ~PAGE_MASK);
+  for (int i = 0; i < NR_TLB; i ++) {
+    TLBEntry *e = &tlb[MEM_TYPE_WRITE][i];
+    if (e->page + e->addend == host) e->page = TLB_INVALID_PAGE;
+  }
+}
+
+// walk the page table on a miss, and cache the translation
+static paddr_t tlb_miss(int type, vaddr_t addr, int len) {
+  paddr_t pg = isa_mmu_translate(addr, len, type);
+  Assert((pg & PAGE_MASK) == MEM_RET_OK, "failed to translate vaddr = " FMT_WORD, fmt_word(addr));
+  paddr_t paddr = pg | (addr & PAGE_MASK);
+  if ((addr & PAGE_MASK) > PAGE_SIZE - len) return paddr;
+
+  uint8_t *host = NULL;
+  if (in_pmem(paddr)) {
+#ifdef CONFIG_CODE_CACHE
+    // stores into pages with cached code should go through paddr_write()
+    if (type == MEM_TYPE_WRITE && pmem_code_page[(paddr - CONFIG_MBASE) >> PAGE_SHIFT]) return paddr;
+#endif
+    // so should all of them if paddr_write() has to see every store
+    if (PMEM_WRITE_HOOKED && type == MEM_TYPE_WRITE) return paddr;
+    host = guest_to_host(pg);
+  }
+#if defined(CONFIG_DEVICE) && !defined(CONFIG_DIFFTEST)
+  // also cache MMIO pages which work like plain memory, but not under
+  // difftest, which should skip the reference on every MMIO access
+  else host = mmio_direct_space(pg, PAGE_SIZE);
+#endif
+  if (host == NULL) return paddr;
+
+  TLBEntry *e = tlb_entry(type, addr);
+  e->page = addr & ~PAGE_MASK;
+  e->addend = (uintptr_t)host - e->page;
+  return paddr;
+}
+
+// accesses without translation go to paddr_*() directly, they need no TLB
 word_t vaddr_ifetch(vaddr_t addr, int len) {
-  return paddr_read(addr, len);
+  if (isa_mmu_check(addr, len, MEM_TYPE_IFETCH) == MMU_DIRECT) return paddr_read(addr, len);
+  uint8_t *host = tlb_lookup(MEM_TYPE_IFETCH, addr, len);
+  if (likely(host != NULL)) return host_read(host, len);
+  return paddr_read(tlb_miss(MEM_TYPE_IFETCH, addr, len), len);
 }
 
 word_t vaddr_read(vaddr_t addr, int len) {
-  return paddr_read(addr, len);
+  if (isa_mmu_check(addr, len, MEM_TYPE_READ) == MMU_DIRECT) return paddr_read(addr, len);
+  uint8_t *host = tlb_lookup(MEM_TYPE_READ, addr, len);
+  if (likely(host != NULL)) return host_read(host, len);
+  return paddr_read(tlb_miss(MEM_TYPE_READ, addr, len), len);
 }
 
 void vaddr_write(vaddr_t addr, int len, word_t data) {
-  paddr_write(addr, len, data);
+  if (isa_mmu_check(addr, len, MEM_TYPE_WRITE) == MMU_DIRECT) { paddr_write(addr, len, data); return; }
+  uint8_t *host = tlb_lookup(MEM_TYPE_WRITE, addr, len);
+  if (likely(host != NULL)) { host_write(host, len, data); return; }
+  paddr_write(tlb_miss(MEM_TYPE_WRITE, addr, len), len, data);
 }
@@ -15,14 +15,19 @@
 
 #include <isa.h>
 #include <memory/paddr.h>
+#include <monitor/snapshot.h>
 
 void init_rand();
 void init_log(const char *log_dir);
 void init_mem();
+void init_mem_fork();
 void init_difftest(char *ref_so_file, long img_size, int port);
 void init_device();
 void init_sdb();
 void init_disasm(const char *triple);
+void init_itrace(const char *log_dir);
+void init_ftrace();
+void init_profiler(const char *log_dir);
 
 static void welcome() {
   Log("Trace: %s", MUXDEF(CONFIG_TRACE, ANSI_FMT("ON", ANSI_FG_GREEN), ANSI_FMT("OFF", ANSI_FG_RED)));
@@ -37,33 +42,106 @@ static void welcome() {
 
 #ifndef CONFIG_TARGET_AM
 #include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <elf.h>
+#include <sys/wait.h>
+
+#define ELF(type) MUXDEF(CONFIG_ISA64, Elf64_ ## type, Elf32_ ## type)
+#define ELF_CLASS MUXDEF(CONFIG_ISA64, ELFCLASS64, ELFCLASS32)
 
 void sdb_set_batch_mode();
+void sdb_set_fork(uint64_t inst, int n, bool set_id, paddr_t id_addr);
+void init_alarm();
 
 static char *log_dir = NULL;
 static char *diff_so_file = NULL;
 static char *img_file = NULL;
+static char *elf_file = NULL;
+static char *snapshot_file = NULL;
 static int difftest_port = 1234;
 
+/* Place `filesz` bytes of the image at `offset` to `addr`, and clear the
+ * rest of `memsz` bytes. The host pages fully covered by the file content
+ * are mapped copy-on-write from the image if their offsets in the file and
+ * in pmem agree, so that they are only read when the guest touches them.
+ * Return the number of bytes mapped. */
+static size_t load_segment(int fd, size_t offset, paddr_t addr, size_t filesz, size_t memsz) {
+  Assert(filesz <= memsz && in_pmem(addr) && memsz <= PMEM_RIGHT - addr + 1,
+      "[" FMT_PADDR ", " FMT_PADDR ") of the image is out of pmem",
+      fmt_paddr(addr), fmt_paddr(addr + (paddr_t)memsz));
+  uint8_t *host = guest_to_host(addr);
+  size_t page = sysconf(_SC_PAGESIZE);
+  // [lo, hi) is mapped, and the rest of the file content is read
+  size_t lo = (page - (uintptr_t)host % page) % page;
+  size_t hi = (filesz > lo ? lo + (filesz - lo) / page * page : lo);
+  bool ok = hi > lo && ((uintptr_t)host - offset) % page == 0 &&
+    paddr_map(addr + lo, hi - lo, fd, offset + lo);
+  if (!ok) lo = hi = filesz;
+  paddr_touch(addr, lo);
+  paddr_touch(addr + hi, filesz - hi);
+  ssize_t ret = pread(fd, host, lo, offset);
+  Assert(ret == (ssize_t)lo, "Can not read the image at offset %zu", offset);
+  ret = pread(fd, host + hi, filesz - hi, offset + hi);
+  Assert(ret == (ssize_t)(filesz - hi), "Can not read the image at offset %zu", offset + hi);
+  memset(host + filesz, 0, memsz - filesz);
+  return hi - lo;
+}
+
+static bool is_elf(const char *file) {
+  char magic[SELFMAG];
+  FILE *fp = fopen(file, "rb");
+  bool ret = fp != NULL && fread(magic, SELFMAG, 1, fp) == 1 && memcmp(magic, ELFMAG, SELFMAG) == 0;
+  if (fp != NULL) fclose(fp);
+  return ret;
+}
+
+// place the PT_LOAD segments at their physical addresses and start at the entry
+static long load_elf(int fd) {
+  ELF(Ehdr) eh;
+  ssize_t ret = pread(fd, &eh, sizeof(eh), 0);
+  Assert(ret == sizeof(eh) && memcmp(eh.e_ident, ELFMAG, SELFMAG) == 0 && eh.e_ident[EI_CLASS] == ELF_CLASS &&
+      eh.e_phnum > 0 && eh.e_phentsize == sizeof(ELF(Phdr)), "'%s' is not an ELF file of the guest", img_file);
+  ELF(Phdr) *ph = malloc(sizeof(*ph) * eh.e_phnum);
+  assert(ph);
+  ret = pread(fd, ph, sizeof(*ph) * eh.e_phnum, eh.e_phoff);
+  Assert(ret == (ssize_t)(sizeof(*ph) * eh.e_phnum), "Can not read the program headers of '%s'", img_file);
+
+  paddr_t end = RESET_VECTOR;
+  size_t mapped = 0;
+  for (int i = 0; i < eh.e_phnum; i ++) {
+    if (ph[i].p_type != PT_LOAD || ph[i].p_memsz == 0) continue;
+    mapped += load_segment(fd, ph[i].p_offset, ph[i].p_paddr, ph[i].p_filesz, ph[i].p_memsz);
+    if (ph[i].p_paddr + ph[i].p_memsz > end) end = ph[i].p_paddr + ph[i].p_memsz;
+  }
+  free(ph);
+
+  cpu.pc = eh.e_entry;
+  Log("The image is %s, an ELF file with entry = " FMT_WORD ", %zu bytes mapped",
+      img_file, fmt_word(eh.e_entry), mapped);
+  // what DiffTest copies from RESET_VECTOR
+  return end - RESET_VECTOR;
+}
+
 static long load_img() {
   if (img_file == NULL) {
     Log("No image is given. Use the default build-in image.");
     return 4096; // built-in image size
   }
 
-  FILE *fp = fopen(img_file, "rb");
-  Assert(fp, "Can not open '%s'", img_file);
+  int fd = open(img_file, O_RDONLY);
+  Assert(fd >= 0, "Can not open '%s'", img_file);
 
-  fseek(fp, 0, SEEK_END);
-  long size = ftell(fp);
-
-  Log("The image is %s, size = %ld", img_file, size);
-
-  fseek(fp, 0, SEEK_SET);
-  int ret = fread(guest_to_host(RESET_VECTOR), size, 1, fp);
-  assert(ret == 1);
+  long size;
+  if (is_elf(img_file)) size = load_elf(fd);
+  else {
+    size = lseek(fd, 0, SEEK_END);
+    size_t mapped = load_segment(fd, 0, RESET_VECTOR, size, size);
+    Log("The image is %s, size = %ld, %zu bytes mapped", img_file, size, mapped);
+  }
 
-  fclose(fp);
+  // the mapped pages stay valid after the file is closed
+  close(fd);
   return size;
 }
 
@@ -73,23 +151,43 @@ static int parse_args(int argc, char *argv[]) {
     {"log"      , required_argument, NULL, 'l'},
     {"diff"     , required_argument, NULL, 'd'},
     {"port"     , required_argument, NULL, 'p'},
+    {"elf"      , required_argument, NULL, 'e'},
+    {"restore"  , required_argument, NULL, 'r'},
+    {"fork"     , required_argument, NULL, 'f'},
     {"help"     , no_argument      , NULL, 'h'},
     {0          , 0                , NULL,  0 },
   };
   int o;
-  while ( (o = getopt_long(argc, argv, "-bhl:d:p:", table, NULL)) != -1) {
+  while ( (o = getopt_long(argc, argv, "-bhl:d:p:e:r:f:", table, NULL)) != -1) {
     switch (o) {
       case 'b': sdb_set_batch_mode(); break;
       case 'p': sscanf(optarg, "%d", &difftest_port); break;
       case 'l': log_dir = optarg; break;
       case 'd': diff_so_file = optarg; break;
+      case 'e': elf_file = optarg; break;
+      case 'r': snapshot_file = optarg; break;
+      case 'f': {
+        uint64_t inst, addr = 0;
+        int n;
+        int ret = sscanf(optarg, "%" SCNu64 ":%d:%" SCNx64, &inst, &n, &addr);
+        Assert((ret == 2 || ret == 3) && n > 0, "Usage: --fork=INST:N[:ADDR]");
+        Assert(ret == 2 || in_pmem(addr), "ADDR of --fork is out of pmem");
+        sdb_set_fork(inst, n, ret == 3, addr);
+        break;
+      }
       case 1: img_file = optarg; return 0;
       default:
         printf("Usage: %s [OPTION...] IMAGE [args]\n\n", argv[0]);
+        printf("IMAGE is loaded at the reset vector, or by its segments if it is an ELF file\n\n");
         printf("\t-b,--batch              run with batch mode\n");
         printf("\t-l,--log=DIR            output log to FILE in DIR\n");
         printf("\t-d,--diff=REF_SO        run DiffTest with reference REF_SO\n");
         printf("\t-p,--port=PORT          run DiffTest with port PORT\n");
+        printf("\t-e,--elf=FILE           read function names from the ELF FILE\n");
+        printf("\t-r,--restore=FILE       restore the machine from the snapshot FILE\n");
+        printf("\t-f,--fork=INST:N[:ADDR] in batch mode, fork N copies of NEMU after INST instructions,\n");
+        printf("\t                        each of which writes its id (0 to N-1) as a 32-bit word to the\n");
+        printf("\t                        physical address ADDR (hex) if given, for the guest to read\n");
         printf("\n");
         exit(0);
     }
@@ -97,6 +195,55 @@ static int parse_args(int argc, char *argv[]) {
   return 0;
 }
 
+static void init_fork(int id) {
+  // interval timers are not inherited by a child
+  IFDEF(CONFIG_DEVICE, init_alarm());
+  init_mem_fork();
+  if (log_dir != NULL) {
+    char *dir = malloc(strlen(log_dir) + 32);
+    sprintf(dir, "%sfork%d-", log_dir, id);
+    log_dir = dir;
+    init_log(log_dir);
+    IFDEF(CONFIG_ITRACE_BINARY, init_itrace(log_dir));
+    IFDEF(CONFIG_PROFILER, init_profiler(log_dir));
+  }
+  extern uint64_t g_nr_guest_inst;
+  Log("fork %d (pid %d) starts at %" PRIu64 " guest instructions", id, getpid(), g_nr_guest_inst);
+}
+
+/* Fork `n` copies of NEMU, which share the unmodified pages of pmem with
+ * the parent. A child writes its logs with the prefix "fork<id>-" in the
+ * log directory, and `fork_run()` returns its id. The parent waits for all
+ * of them, sets `nr_fail` to the number of children failing, and returns -1. */
+int fork_run(int n, int *nr_fail) {
+  Assert(ISNDEF(CONFIG_DIFFTEST), "can not fork with DiffTest");
+  // or the buffered output would be written by every child
+  fflush(NULL);
+  pid_t *pid = malloc(sizeof(pid_t) * n);
+  assert(pid);
+  for (int i = 0; i < n; i ++) {
+    pid[i] = fork();
+    Assert(pid[i] >= 0, "Can not fork");
+    if (pid[i] == 0) {
+      free(pid);
+      init_fork(i);
+      return i;
+    }
+  }
+
+  *nr_fail = 0;
+  for (int i = 0; i < n; i ++) {
+    int status;
+    waitpid(pid[i], &status, 0);
+    bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    if (WIFEXITED(status)) Log("fork %d (pid %d) exits with %d", i, pid[i], WEXITSTATUS(status));
+    else Log("fork %d (pid %d) is killed by signal %d", i, pid[i], WTERMSIG(status));
+    if (!ok) (*nr_fail) ++;
+  }
+  free(pid);
+  return -1;
+}
+
 void init_monitor(int argc, char *argv[]) {
   /* Perform some global initialization. */
 
@@ -108,6 +255,12 @@ void init_monitor(int argc, char *argv[]) {
 
   /* Open the log file. */
   init_log(log_dir);
+  IFDEF(CONFIG_ITRACE_BINARY, init_itrace(log_dir));
+  /* Read the symbols for the tracers, from the image if it is an ELF file. */
+  if (elf_file == NULL && img_file != NULL && is_elf(img_file)) elf_file = img_file;
+  init_symbol(elf_file);
+  IFDEF(CONFIG_FTRACE, init_ftrace());
+  IFDEF(CONFIG_PROFILER, init_profiler(log_dir));
 
   /* Initialize memory. */
   init_mem();
@@ -121,6 +274,16 @@ void init_monitor(int argc, char *argv[]) {
   /* Load the image to memory. This will overwrite the built-in image. */
   long img_size = load_img();
 
+  /* Restore the machine from a snapshot. This will overwrite the image. */
+  if (snapshot_file != NULL) {
+#ifdef CONFIG_SNAPSHOT
+    bool ok = snapshot_load(snapshot_file);
+    Assert(ok, "Can not restore from '%s'", snapshot_file);
+#else
+    panic("snapshot is not enabled, turn on CONFIG_SNAPSHOT in menuconfig");
+#endif
+  }
+
   /* Initialize differential testing. */
   init_difftest(diff_so_file, img_size, difftest_port);
 
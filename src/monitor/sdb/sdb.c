@@ -16,14 +16,25 @@
 #include <isa.h>
 #include <cpu/cpu.h>
 #include <memory/vaddr.h>
+#include <memory/paddr.h>
+#include <cpu/ftrace.h>
+#include <cpu/profiler.h>
+#include <monitor/snapshot.h>
 #include <readline/readline.h>
 #include <readline/history.h>
 #include "sdb.h"
 
 static int is_batch_mode = false;
+// in batch mode, fork `nr_fork` copies of NEMU after `fork_inst` instructions
+static uint64_t fork_inst = 0;
+static int nr_fork = 0;
+// if set, a child writes its id to `fork_id_addr`, to tell it from the other ones
+static bool fork_id = false;
+static paddr_t fork_id_addr = 0;
 
 void init_regex();
 void init_wp_pool();
+int fork_run(int n, int *nr_fail);
 
 /* We use the `readline' library to provide more flexibility to read from stdin. */
 static char* rl_gets() {
@@ -159,6 +170,74 @@ static int cmd_d(char *args) {
 }
 #endif
 
+#ifdef CONFIG_FTRACE
+static int cmd_ftrace(char *args) {
+  ftrace_dump(stdout);
+  return 0;
+}
+#endif
+
+#ifdef CONFIG_PROFILER
+static int cmd_profile(char *args) {
+  profiler_dump(stdout);
+  return 0;
+}
+#endif
+
+#ifdef CONFIG_SNAPSHOT
+static int cmd_save(char *args) {
+  char *file = strtok(args, " ");
+  if (file == NULL) {
+    printf(ANSI_FMT("command error: need file\n", ANSI_FG_RED));
+    return 0;
+  }
+  snapshot_save(file);
+  return 0;
+}
+
+static int cmd_load(char *args) {
+  char *file = strtok(args, " ");
+  if (file == NULL) {
+    printf(ANSI_FMT("command error: need file\n", ANSI_FG_RED));
+    return 0;
+  }
+  if (!snapshot_load(file)) printf("Load snapshot fail\n");
+  return 0;
+}
+#endif
+
+// fork `n` copies of NEMU, and in a child, write its id as a word to `id_addr` if `set_id`
+static int fork_with_id(int n, bool set_id, paddr_t id_addr, int *nr_fail) {
+  int id = fork_run(n, nr_fail);
+  if (id >= 0 && set_id) paddr_write(id_addr, 4, id);
+  return id;
+}
+
+#ifndef CONFIG_DIFFTEST
+static int cmd_fork(char *args) {
+  int n = 0;
+  uint64_t addr = 0;
+  int ret = (args == NULL ? 0 : sscanf(args, "%d %" SCNx64, &n, &addr));
+  if (ret < 1 || n <= 0) {
+    printf(ANSI_FMT("command error: need the number of forks\n", ANSI_FG_RED));
+    return 0;
+  }
+  paddr_t id_addr = addr;
+  if (ret == 2 && !in_pmem(id_addr)) {
+    printf(ANSI_FMT("command error: the address is out of pmem\n", ANSI_FG_RED));
+    return 0;
+  }
+  int nr_fail;
+  if (fork_with_id(n, ret == 2, id_addr, &nr_fail) >= 0) {
+    // a child runs the rest of the program without the debugger
+    cpu_exec(-1);
+    return -1;
+  }
+  printf("%d of %d forks failed\n", nr_fail, n);
+  return 0;
+}
+#endif
+
 static int cmd_help(char *args);
 
 static struct {
@@ -175,6 +254,12 @@ static struct {
   {"x", "scan memory", cmd_x},
   IFDEF(CONFIG_WATCH_POINT, {"d", "delete watchpoint", cmd_d},)
   IFDEF(CONFIG_WATCH_POINT,{"w", "set watchpoint", cmd_w},)
+  IFDEF(CONFIG_FTRACE, {"ftrace", "print the call tree of the latest calls", cmd_ftrace},)
+  IFDEF(CONFIG_PROFILER, {"profile", "print the samples of the profiler as folded stacks", cmd_profile},)
+  IFDEF(CONFIG_SNAPSHOT, {"save", "save the machine into a snapshot file", cmd_save},)
+  IFDEF(CONFIG_SNAPSHOT, {"load", "load the machine from a snapshot file", cmd_load},)
+  IFNDEF(CONFIG_DIFFTEST, {"fork", "run the rest of the program in N copies of NEMU, "
+      "each writing its id to ADDR if given", cmd_fork},)
 };
 
 #define NR_CMD ARRLEN(cmd_table)
@@ -205,8 +290,25 @@ void sdb_set_batch_mode() {
   is_batch_mode = true;
 }
 
+void sdb_set_fork(uint64_t inst, int n, bool set_id, paddr_t id_addr) {
+  fork_inst = inst;
+  nr_fork = n;
+  fork_id = set_id;
+  fork_id_addr = id_addr;
+}
+
 void sdb_mainloop() {
   if (is_batch_mode) {
+    if (nr_fork > 0) {
+      cpu_exec(fork_inst);
+      // the program has ended before the forks
+      if (nemu_state.state != NEMU_STOP) return;
+      int nr_fail;
+      if (fork_with_id(nr_fork, fork_id, fork_id_addr, &nr_fail) < 0) {
+        nemu_state.state = (nr_fail == 0 ? NEMU_QUIT : NEMU_ABORT);
+        return;
+      }
+    }
     cmd_c(NULL);
     return;
   }
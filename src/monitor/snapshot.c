@@ -0,0 +1,226 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <memory/paddr.h>
+#include <device/map.h>
+#include <device/event.h>
+#include <monitor/snapshot.h>
+
+#ifdef CONFIG_SNAPSHOT
+#include <fcntl.h>
+#include <unistd.h>
+
+/* The layout of a snapshot file:
+ *   SnapshotHeader
+ *   CPU_state
+ *   the space from new_space()
+ *   each section: SectionHeader, then its data
+ *   pmem, at `pmem_offset` which is aligned to the page size of the host
+ * Pages of pmem filled with zero are left as holes in the file. */
+
+#define SNAPSHOT_MAGIC "NEMUSNAP"
+#define MAX_SECTION 16
+
+typedef struct {
+  char magic[8];
+  char isa[16];
+  uint64_t mbase, msize;
+  uint64_t cpu_size, io_size;
+  uint64_t nr_section;
+  uint64_t nr_inst;
+  uint64_t pmem_offset;
+} SnapshotHeader;
+
+typedef struct {
+  char name[32];
+  uint64_t size;
+} SectionHeader;
+
+static struct {
+  const char *name;
+  void *data;
+  size_t size;
+  snapshot_hook_t hook;
+} section[MAX_SECTION];
+static int nr_section = 0;
+
+extern uint64_t g_nr_guest_inst;
+
+void snapshot_add(const char *name, void *data, size_t size, snapshot_hook_t hook) {
+  assert(nr_section < MAX_SECTION);
+  assert(strlen(name) < sizeof(((SectionHeader *)0)->name));
+  section[nr_section ++] = (typeof(section[0])) { name, data, size, hook };
+}
+
+static void init_header(SnapshotHeader *h) {
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic));
+  strncpy(h->isa, str(__GUEST_ISA__), sizeof(h->isa) - 1);
+  h->mbase = CONFIG_MBASE;
+  h->msize = CONFIG_MSIZE;
+  h->cpu_size = sizeof(cpu);
+  size_t io_size;
+  io_space_used(&io_size);
+  h->io_size = io_size;
+  h->nr_section = nr_section;
+}
+
+static void write_pmem(FILE *fp, size_t offset) {
+  static const uint8_t zero[PAGE_SIZE] = {};
+  uint8_t *p = guest_to_host(PMEM_LEFT);
+  for (size_t i = 0; i < CONFIG_MSIZE; i += PAGE_SIZE) {
+    if (memcmp(p + i, zero, PAGE_SIZE) == 0) continue;
+    fseek(fp, offset + i, SEEK_SET);
+    fwrite(p + i, PAGE_SIZE, 1, fp);
+  }
+  fflush(fp);
+  __attribute__((unused)) int ret = ftruncate(fileno(fp), offset + CONFIG_MSIZE);
+}
+
+bool snapshot_save(const char *file) {
+  // write a new file instead of truncating the old one, which may still be
+  // mapped as pmem
+  char tmp[strlen(file) + 8];
+  sprintf(tmp, "%s.tmp", file);
+  FILE *fp = fopen(tmp, "wb");
+  if (fp == NULL) {
+    Log("can not open '%s'", tmp);
+    return false;
+  }
+
+  for (int i = 0; i < nr_section; i ++) {
+    if (section[i].hook != NULL) section[i].hook(true);
+  }
+
+  SnapshotHeader h;
+  init_header(&h);
+  h.nr_inst = g_nr_guest_inst;
+  fwrite(&h, sizeof(h), 1, fp);
+  fwrite(&cpu, sizeof(cpu), 1, fp);
+  size_t io_size;
+  uint8_t *io = io_space_used(&io_size);
+  fwrite(io, io_size, 1, fp);
+  for (int i = 0; i < nr_section; i ++) {
+    SectionHeader sh = { .size = section[i].size };
+    strcpy(sh.name, section[i].name);
+    fwrite(&sh, sizeof(sh), 1, fp);
+    fwrite(section[i].data, section[i].size, 1, fp);
+  }
+
+  long page = sysconf(_SC_PAGESIZE);
+  h.pmem_offset = (ftell(fp) + page - 1) / page * page;
+  write_pmem(fp, h.pmem_offset);
+  rewind(fp);
+  fwrite(&h, sizeof(h), 1, fp);
+
+  bool ok = !ferror(fp);
+  ok = (fclose(fp) == 0) && ok;
+  if (ok) ok = (rename(tmp, file) == 0);
+  if (!ok) {
+    Log("can not write the snapshot to '%s'", file);
+    remove(tmp);
+    return false;
+  }
+  Log("snapshot saved to %s at %" PRIu64 " guest instructions", file, g_nr_guest_inst);
+  return true;
+}
+
+static bool check_header(const SnapshotHeader *h) {
+  SnapshotHeader expect;
+  init_header(&expect);
+  if (memcmp(h->magic, expect.magic, sizeof(h->magic)) != 0) {
+    Log("not a snapshot");
+    return false;
+  }
+  if (strncmp(h->isa, expect.isa, sizeof(h->isa)) != 0 || h->mbase != expect.mbase ||
+      h->msize != expect.msize || h->cpu_size != expect.cpu_size ||
+      h->io_size != expect.io_size || h->nr_section != expect.nr_section) {
+    Log("the snapshot is taken by a NEMU configured differently");
+    return false;
+  }
+  return true;
+}
+
+// find the data of each section in `buf`, which holds all of them
+static bool find_sections(uint8_t *buf, size_t len, uint8_t *data[]) {
+  for (int i = 0; i < nr_section; i ++) {
+    data[i] = NULL;
+    for (size_t pos = 0; pos + sizeof(SectionHeader) <= len; ) {
+      SectionHeader *sh = (SectionHeader *)(buf + pos);
+      pos += sizeof(*sh);
+      if (sh->size > len - pos) break;
+      if (strncmp(sh->name, section[i].name, sizeof(sh->name)) == 0 && sh->size == section[i].size) {
+        data[i] = buf + pos;
+        break;
+      }
+      pos += sh->size;
+    }
+    if (data[i] == NULL) {
+      Log("section '%s' is not found in the snapshot", section[i].name);
+      return false;
+    }
+  }
+  return true;
+}
+
+bool snapshot_load(const char *file) {
+  int fd = open(file, O_RDONLY);
+  if (fd < 0) {
+    Log("can not open '%s'", file);
+    return false;
+  }
+
+  bool ok = false;
+  uint8_t *buf = NULL;
+  SnapshotHeader h;
+  if (pread(fd, &h, sizeof(h), 0) != sizeof(h) || !check_header(&h)) goto out;
+
+  // everything between the header and pmem
+  size_t len = h.pmem_offset - sizeof(h);
+  buf = malloc(len);
+  assert(buf);
+  if (pread(fd, buf, len, sizeof(h)) != len) {
+    Log("the snapshot is truncated");
+    goto out;
+  }
+  uint8_t *data[MAX_SECTION];
+  size_t skip = h.cpu_size + h.io_size;
+  if (skip > len || !find_sections(buf + skip, len - skip, data)) goto out;
+
+  memcpy(&cpu, buf, sizeof(cpu));
+  size_t io_size;
+  uint8_t *io = io_space_used(&io_size);
+  memcpy(io, buf + h.cpu_size, io_size);
+  for (int i = 0; i < nr_section; i ++) {
+    memcpy(section[i].data, data[i], section[i].size);
+    if (section[i].hook != NULL) section[i].hook(false);
+  }
+  paddr_map_file(fd, h.pmem_offset);
+
+  IFDEF(CONFIG_EVENT_QUEUE, event_shift(h.nr_inst - g_nr_guest_inst));
+  g_nr_guest_inst = h.nr_inst;
+  // the program may have ended after the snapshot was taken
+  nemu_state.state = NEMU_STOP;
+  Log("snapshot loaded from %s at %" PRIu64 " guest instructions", file, g_nr_guest_inst);
+  ok = true;
+
+out:
+  free(buf);
+  // the mapping of pmem is kept after the file is closed
+  close(fd);
+  return ok;
+}
+#endif
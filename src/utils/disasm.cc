@@ -22,6 +22,7 @@
 #include "llvm/MC/MCContext.h"
 #include "llvm/MC/MCDisassembler/MCDisassembler.h"
 #include "llvm/MC/MCInstPrinter.h"
+#include "llvm/MC/MCInstrInfo.h"
 #if LLVM_VERSION_MAJOR >= 14
 #include "llvm/MC/TargetRegistry.h"
 #if LLVM_VERSION_MAJOR >= 15
@@ -40,11 +41,66 @@
 #error Please use LLVM with major version >= 11
 #endif
 
+#include <list>
+#include <unordered_map>
+
 using namespace llvm;
 
 static llvm::MCDisassembler *gDisassembler = nullptr;
 static llvm::MCSubtargetInfo *gSTI = nullptr;
 static llvm::MCInstPrinter *gIP = nullptr;
+static llvm::MCInstrInfo *gMII = nullptr;
+
+/* Formatted instructions, indexed by their encoding. The pc is only part of
+ * the key when the text depends on it, e.g. the target of a branch. The
+ * least recently used entry is replaced when the cache is full. */
+#define DISASM_CACHE_SIZE 4096
+
+struct CacheKey {
+  uint64_t code;
+  uint64_t pc;
+  int nbyte;
+  bool pcrel;
+  bool operator==(const CacheKey &k) const {
+    return code == k.code && pc == k.pc && nbyte == k.nbyte && pcrel == k.pcrel;
+  }
+};
+
+struct CacheKeyHash {
+  size_t operator()(const CacheKey &k) const {
+    return (k.code * 0x9e3779b97f4a7c15ull) ^ k.pc ^ k.nbyte;
+  }
+};
+
+typedef std::list<std::pair<CacheKey, std::string>> LruList;
+static LruList lru; // the most recently used first
+static std::unordered_map<CacheKey, LruList::iterator, CacheKeyHash> cache;
+
+static const std::string *cache_lookup(const CacheKey &key) {
+  auto it = cache.find(key);
+  if (it == cache.end()) return nullptr;
+  lru.splice(lru.begin(), lru, it->second);
+  return &it->second->second;
+}
+
+static const std::string *cache_insert(const CacheKey &key, std::string &&text) {
+  if (cache.size() == DISASM_CACHE_SIZE) {
+    cache.erase(lru.back().first);
+    lru.pop_back();
+  }
+  lru.emplace_front(key, std::move(text));
+  cache[key] = lru.begin();
+  return &lru.front().second;
+}
+
+static bool is_pcrel(const MCInst &inst) {
+  const MCInstrDesc &desc = gMII->get(inst.getOpcode());
+  if (desc.isBranch() || desc.isCall()) return true;
+  for (const MCOperandInfo &op : desc.operands()) {
+    if (op.OperandType == MCOI::OPERAND_PCREL) return true;
+  }
+  return false;
+}
 
 extern "C" void init_disasm(const char *triple) {
   llvm::InitializeAllTargetInfos();
@@ -55,7 +111,6 @@ extern "C" void init_disasm(const char *triple) {
   std::string errstr;
   std::string gTriple(triple);
 
-  llvm::MCInstrInfo *gMII = nullptr;
   llvm::MCRegisterInfo *gMRI = nullptr;
   auto target = llvm::TargetRegistry::lookupTarget(gTriple, errstr);
   if (!target) {
@@ -92,18 +147,45 @@ extern "C" void init_disasm(const char *triple) {
     gIP->applyTargetSpecificCLOption("no-aliases");
 }
 
-extern "C" void disassemble(char *str, int size, uint64_t pc, uint8_t *code, int nbyte) {
+static std::string do_disassemble(uint64_t pc, uint8_t *code, int nbyte, bool *pcrel) {
   MCInst inst;
   llvm::ArrayRef<uint8_t> arr(code, nbyte);
   uint64_t dummy_size = 0;
   gDisassembler->getInstruction(inst, dummy_size, arr, pc, llvm::nulls());
+  *pcrel = is_pcrel(inst);
 
   std::string s;
   raw_string_ostream os(s);
   gIP->printInst(&inst, pc, "", *gSTI, os);
+  os.flush();
+
+  size_t skip = s.find_first_not_of('\t');
+  return (skip == std::string::npos ? std::string() : s.substr(skip));
+}
+
+extern "C" void disassemble(char *str, int size, uint64_t pc, uint8_t *code, int nbyte) {
+  std::string uncached;
+  const std::string *text = nullptr;
+  if (nbyte <= (int)sizeof(uint64_t)) {
+    // try the pc-independent entry first
+    CacheKey key = { 0, 0, nbyte, false };
+    memcpy(&key.code, code, nbyte);
+    text = cache_lookup(key);
+    if (text == nullptr) {
+      CacheKey key_pc = { key.code, pc, nbyte, true };
+      text = cache_lookup(key_pc);
+      if (text == nullptr) {
+        bool pcrel;
+        std::string s = do_disassemble(pc, code, nbyte, &pcrel);
+        text = cache_insert(pcrel ? key_pc : key, std::move(s));
+      }
+    }
+  } else {
+    bool pcrel;
+    uncached = do_disassemble(pc, code, nbyte, &pcrel);
+    text = &uncached;
+  }
 
-  int skip = s.find_first_not_of('\t');
-  const char *p = s.c_str() + skip;
-  assert((int)s.length() - skip < size);
-  strcpy(str, p);
+  assert((int)text->length() < size);
+  strcpy(str, text->c_str());
 }
@@ -18,6 +18,9 @@
 extern uint64_t g_nr_guest_inst;
 
 #ifndef CONFIG_TARGET_AM
+// a log file is only written when this much is buffered, or by log_flush()
+#define LOG_BUF_SIZE (1 << 20)
+
 FILE *log_fp[TAB_LEN(log)] = {0};
 
 #define logfile_name(x) [GETID(x, log)] = str(GETID(x, log)),
@@ -26,6 +29,8 @@ const char *const log_file[] = {MAP(log_type, logfile_name)};
 void init_log(const char *log_dir) {
   for_idx_in_table(i, log) {
     char file[256];
+    // called again by a forked child to write its own files
+    if (log_fp[i] != NULL && log_fp[i] != stdout) fclose(log_fp[i]);
     log_fp[i] = stdout;
     if (log_dir != NULL) {
       unsigned long len = strlen(log_file[i]) + strlen(log_dir);
@@ -38,12 +43,19 @@ void init_log(const char *log_dir) {
       
       FILE *fp = fopen(file, "w");
       Assert(fp, "Can not open '%s'", log_dir);
+      setvbuf(fp, NULL, _IOFBF, LOG_BUF_SIZE);
       log_fp[i] = fp;
     }
     Log("%s is written to %s", log_file[i], log_dir ? file : "stdout");
   }
 }
 
+void log_flush() {
+  for_idx_in_table(i, log) {
+    if (log_fp[i] != NULL) fflush(log_fp[i]);
+  }
+}
+
 bool log_enable() {
   return MUXDEF(CONFIG_TRACE, (g_nr_guest_inst >= CONFIG_TRACE_START) &&
          (g_nr_guest_inst <= CONFIG_TRACE_END), false);
@@ -0,0 +1,99 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <common.h>
+#include <elf.h>
+
+#ifndef CONFIG_TARGET_AM
+#define ELF(type) MUXDEF(CONFIG_ISA64, Elf64_ ## type, Elf32_ ## type)
+#define ELF_CLASS MUXDEF(CONFIG_ISA64, ELFCLASS64, ELFCLASS32)
+
+typedef struct {
+  vaddr_t addr;
+  word_t size;
+  const char *name;
+} Symbol;
+
+// functions sorted by address, a symbol ID is an index into this array
+static Symbol *sym = NULL;
+static int nr_sym = 0;
+
+static void read_at(FILE *fp, long offset, void *buf, size_t size) {
+  if (size == 0) return; // e.g. no section headers
+  int ret = fseek(fp, offset, SEEK_SET);
+  Assert(ret == 0 && fread(buf, size, 1, fp) == 1, "Can not read the ELF file at offset %ld", offset);
+}
+
+static int sym_cmp(const void *a, const void *b) {
+  vaddr_t x = ((const Symbol *)a)->addr, y = ((const Symbol *)b)->addr;
+  return (x > y) - (x < y);
+}
+
+void init_symbol(const char *elf_file) {
+  if (elf_file == NULL) return;
+
+  FILE *fp = fopen(elf_file, "rb");
+  Assert(fp, "Can not open '%s'", elf_file);
+
+  ELF(Ehdr) eh;
+  read_at(fp, 0, &eh, sizeof(eh));
+  Assert(memcmp(eh.e_ident, ELFMAG, SELFMAG) == 0 && eh.e_ident[EI_CLASS] == ELF_CLASS,
+      "'%s' is not an ELF file of the guest", elf_file);
+
+  ELF(Shdr) *sh = malloc(sizeof(*sh) * eh.e_shnum);
+  read_at(fp, eh.e_shoff, sh, sizeof(*sh) * eh.e_shnum);
+  for (int i = 0; i < eh.e_shnum; i ++) {
+    if (sh[i].sh_type != SHT_SYMTAB) continue;
+    ELF(Shdr) *strsh = &sh[sh[i].sh_link];
+    char *strtab = malloc(strsh->sh_size);
+    read_at(fp, strsh->sh_offset, strtab, strsh->sh_size);
+    int n = sh[i].sh_size / sizeof(ELF(Sym));
+    ELF(Sym) *st = malloc(sizeof(*st) * n);
+    read_at(fp, sh[i].sh_offset, st, sizeof(*st) * n);
+
+    sym = realloc(sym, sizeof(*sym) * (nr_sym + n));
+    for (int j = 0; j < n; j ++) {
+      if (ELF32_ST_TYPE(st[j].st_info) != STT_FUNC || st[j].st_value == 0) continue;
+      sym[nr_sym ++] = (Symbol) { .addr = st[j].st_value, .size = st[j].st_size,
+        .name = strtab + st[j].st_name };
+    }
+    free(st);
+  }
+  free(sh);
+  fclose(fp);
+
+  qsort(sym, nr_sym, sizeof(*sym), sym_cmp);
+  Log("Read %d functions from %s", nr_sym, elf_file);
+}
+
+int symbol_find(vaddr_t pc) {
+  int lo = 0, hi = nr_sym - 1, found = -1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (sym[mid].addr <= pc) { found = mid; lo = mid + 1; }
+    else hi = mid - 1;
+  }
+  if (found != -1 && sym[found].size != 0 && pc - sym[found].addr >= sym[found].size) return -1;
+  return found;
+}
+
+const char *symbol_name(int id) {
+  return sym[id].name;
+}
+
+int symbol_count() {
+  return nr_sym;
+}
+#endif
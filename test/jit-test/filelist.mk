@@ -0,0 +1 @@
+DIRS-y += test/jit-test
@@ -0,0 +1,70 @@
+#include <isa.h>
+#include <cpu/cpu.h>
+#include <memory/paddr.h>
+#ifdef CONFIG_JIT_TEST
+#include <jit.h>
+
+void init_log(const char *log_dir);
+void init_mem();
+
+#define N 1000
+
+// 8 + N * 13 + 2 instructions
+static const uint32_t prog[] = {
+  0x00000417, //       auipc s0, 0
+  0x00000293, //       addi  t0, zero, 0
+  0x3e800313, //       addi  t1, zero, N
+  0x05440493, //       addi  s1, s0, f1
+  0x05840913, //       addi  s2, s0, f2
+  0x05440993, //       addi  s3, s0, f1
+  0x05840a13, //       addi  s4, s0, f2
+  0x05c40a93, //       addi  s5, s0, f3
+  0x000480e7, // loop: jalr  ra, 0(s1)   # f1 and f2 in turn, hit after warming up
+  0x00048393, //       addi  t2, s1, 0
+  0x00090493, //       addi  s1, s2, 0
+  0x00038913, //       addi  s2, t2, 0
+  0x000980e7, //       jalr  ra, 0(s3)   # f1, f2 and f3 in turn, always miss
+  0x00098393, //       addi  t2, s3, 0
+  0x000a0993, //       addi  s3, s4, 0
+  0x000a8a13, //       addi  s4, s5, 0
+  0x00038a93, //       addi  s5, t2, 0
+  0x00128293, //       addi  t0, t0, 1
+  0xfc629ce3, //       bne   t0, t1, loop
+  0x00000513, //       addi  a0, zero, 0
+  0x00100073, //       ebreak
+  0x00008067, // f1:   jalr  zero, 0(ra) # two return addresses, hit after warming up
+  0x00008067, // f2:   jalr  zero, 0(ra)
+  0x00008067, // f3:   jalr  zero, 0(ra)
+};
+
+#define check(cond) do { \
+  if (!(cond)) { printf("check failed: %s\n", #cond); fails ++; } \
+} while (0)
+
+int main(int argc, char *argv[]) {
+  init_log(NULL);
+  init_mem();
+  init_isa();
+  memcpy(guest_to_host(RESET_VECTOR), prog, sizeof(prog));
+
+  cpu_exec(-1);
+
+  extern uint64_t g_nr_guest_inst;
+  int fails = 0;
+  check(nemu_state.state == NEMU_END && nemu_state.halt_ret == 0);
+  check(g_nr_guest_inst == 8 + N * 13 + 2);
+  // the loop runs without returning to execute(), except for translating
+  // the blocks reached for the first time
+  check(jit_stat.nr_run < 32);
+  check(jit_stat.nr_chain > 0);
+  // the second call site misses every time and evicts an entry, the
+  // other indirect jumps only miss while the blocks are translated
+  check(jit_stat.nr_ic_miss >= N && jit_stat.nr_ic_miss < N + 16);
+  check(jit_stat.nr_ic_evict >= N - 16);
+
+  printf("run = %" PRIu64 ", chain = %" PRIu64 ", ic miss = %" PRIu64 ", ic evict = %" PRIu64 "\n",
+      jit_stat.nr_run, jit_stat.nr_chain, jit_stat.nr_ic_miss, jit_stat.nr_ic_evict);
+  printf("%s\n", fails == 0 ? "PASS" : "FAIL");
+  return fails != 0;
+}
+#endif
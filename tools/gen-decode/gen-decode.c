@@ -0,0 +1,265 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+/* Read a source file preprocessed with -DDECODE_TREE_GEN, where every
+ * INSTPAT_START(), INSTPAT() and INSTPAT_END() has been turned into a
+ * marker (see include/cpu/decode.h), and write a header with one decision
+ * tree per INSTPAT table. A tree returns the index of the first pattern
+ * in the table matching the instruction, or -1 if there is none. */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#define MAX_PAT 4096
+// the widest field a single switch looks at
+#define MAX_FIELD_BITS 8
+// no switch is built for this many patterns or less
+#define MAX_LINEAR 2
+
+typedef struct {
+  uint64_t key, mask;
+} Pattern;
+
+static Pattern pat[MAX_PAT];
+static int npat = 0;
+
+static const char *src = NULL;
+static int line = 1;
+
+static void error(const char *msg) {
+  fprintf(stderr, "gen-decode: line %d: %s\n", line, msg);
+  exit(1);
+}
+
+static void skip_space() {
+  while (isspace(*src)) { if (*src == '\n') line ++; src ++; }
+}
+
+// read one or more adjacent string literals into `buf`
+static void read_string(char *buf, int size) {
+  int n = 0;
+  skip_space();
+  if (*src != '"') error("string literal expected");
+  while (*src == '"') {
+    for (src ++; *src != '"'; src ++) {
+      if (*src == '\0' || *src == '\n') error("unterminated string literal");
+      if (*src == '\\') error("escape sequence in pattern");
+      if (n == size - 1) error("string literal too long");
+      buf[n ++] = *src;
+    }
+    src ++;
+    skip_space();
+  }
+  buf[n] = '\0';
+}
+
+static void read_marker_arg(char *buf, int size) {
+  skip_space();
+  if (*src != '(') error("'(' expected");
+  src ++;
+  read_string(buf, size);
+  if (*src != ')') error("')' expected");
+  src ++;
+}
+
+// the same as pattern_decode() in include/cpu/decode.h, but not shifted
+static void add_pattern(const char *str) {
+  uint64_t key = 0, mask = 0;
+  int len = 0;
+  for (; *str != '\0'; str ++) {
+    char c = *str;
+    if (c == ' ') continue;
+    if (c != '0' && c != '1' && c != '?') error("invalid character in pattern string");
+    if (++ len > 64) error("pattern too long");
+    key  = (key  << 1) | (c == '1');
+    mask = (mask << 1) | (c != '?');
+  }
+  if (npat == MAX_PAT) error("too many patterns");
+  pat[npat ++] = (Pattern) { .key = key, .mask = mask };
+}
+
+static void indent(int level) {
+  printf("%*s", level * 2, "");
+}
+
+/* Emit the code returning the first pattern in `cand` which matches the
+ * instruction, given that the bits in `fixed` are already known to match
+ * every pattern in `cand`. */
+static void gen_tree(const int *cand, int n, uint64_t fixed, int level) {
+  // patterns behind the first one matching everything left can never be chosen
+  int total = -1;
+  for (int i = 0; i < n; i ++) {
+    if ((pat[cand[i]].mask & ~fixed) == 0) { total = cand[i]; n = i; break; }
+  }
+
+  if (n <= MAX_LINEAR) {
+    for (int i = 0; i < n; i ++) {
+      uint64_t mask = pat[cand[i]].mask & ~fixed;
+      indent(level);
+      printf("if ((inst & 0x%llxull) == 0x%llxull) return %d;\n",
+          (unsigned long long)mask, (unsigned long long)(pat[cand[i]].key & mask), cand[i]);
+    }
+    indent(level);
+    printf("return %d;\n", total);
+    return;
+  }
+
+  // prefer the bits checked by all of the patterns, such as an opcode field
+  uint64_t common = ~fixed;
+  for (int i = 0; i < n; i ++) common &= pat[cand[i]].mask;
+  if (common == 0) common = pat[cand[0]].mask & ~fixed;
+
+  // switch on the widest run of contiguous bits in `common`
+  int lo = 0, width = 0;
+  for (int i = 0; i < 64; ) {
+    if (!(common >> i & 1)) { i ++; continue; }
+    int j = i;
+    while (j < 64 && (common >> j & 1)) j ++;
+    if (j - i > width) { lo = i; width = j - i; }
+    i = j;
+  }
+  if (width > MAX_FIELD_BITS) width = MAX_FIELD_BITS;
+  uint64_t field = ((1ull << width) - 1) << lo;
+  int nval = 1 << width;
+
+  // collect the candidates for each value of the field, and merge the values
+  // with the same candidates since their subtrees are the same
+  int (*sub)[n + 1] = malloc(sizeof(int [nval][n + 1]));
+  int *nsub = malloc(sizeof(int) * nval);
+  int *group = malloc(sizeof(int) * nval);
+  int *group_size = calloc(nval, sizeof(int));
+  for (int v = 0; v < nval; v ++) {
+    uint64_t val = (uint64_t)v << lo;
+    nsub[v] = 0;
+    for (int i = 0; i < n; i ++) {
+      Pattern *p = &pat[cand[i]];
+      if (((p->key ^ val) & p->mask & field) == 0) sub[v][nsub[v] ++] = cand[i];
+    }
+    if (total != -1) sub[v][nsub[v] ++] = total;
+    group[v] = -1;
+    for (int u = 0; u < v; u ++) {
+      if (group[u] == u && nsub[u] == nsub[v] && memcmp(sub[u], sub[v], sizeof(int) * nsub[v]) == 0) {
+        group[v] = u;
+        break;
+      }
+    }
+    if (group[v] == -1) group[v] = v;
+    group_size[group[v]] ++;
+  }
+
+  // the largest group becomes the default case
+  int dflt = 0;
+  for (int v = 0; v < nval; v ++) {
+    if (group_size[v] > group_size[dflt]) dflt = v;
+  }
+
+  indent(level);
+  printf("switch ((inst >> %d) & 0x%x) {\n", lo, nval - 1);
+  for (int u = 0; u < nval; u ++) {
+    if (group[u] != u) continue;
+    indent(level + 1);
+    if (u == dflt) printf("default:");
+    else {
+      for (int v = u; v < nval; v ++) {
+        if (group[v] == u) printf("%scase 0x%x:", (v == u ? "" : " "), v);
+      }
+    }
+    printf("\n");
+    gen_tree(sub[u], nsub[u], fixed | field, level + 2);
+  }
+  indent(level);
+  printf("}\n");
+
+  free(sub);
+  free(nsub);
+  free(group);
+  free(group_size);
+}
+
+static void gen_table(const char *name) {
+  int *cand = malloc(sizeof(int) * (npat + 1));
+  for (int i = 0; i < npat; i ++) cand[i] = i;
+  printf("#define __decode_tree_nr_%s %d\n", name, npat);
+  printf("static inline int __decode_tree_%s(uint64_t inst) {\n", name);
+  gen_tree(cand, npat, 0, 1);
+  printf("}\n\n");
+  free(cand);
+}
+
+static char *read_file(FILE *fp) {
+  size_t size = 0, cap = 65536;
+  char *buf = malloc(cap);
+  size_t n;
+  while ((n = fread(buf + size, 1, cap - size - 1, fp)) > 0) {
+    size += n;
+    if (size == cap - 1) buf = realloc(buf, cap *= 2);
+  }
+  buf[size] = '\0';
+  return buf;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s FILE.i\n", argv[0]);
+    return 1;
+  }
+  FILE *fp = fopen(argv[1], "r");
+  if (fp == NULL) { perror(argv[1]); return 1; }
+  src = read_file(fp);
+  fclose(fp);
+
+  printf("// generated by tools/gen-decode from %s, do not edit\n\n", argv[1]);
+  printf("#include <stdint.h>\n\n");
+
+  char name[256] = "", buf[256];
+  bool in_table = false;
+  while (*src != '\0') {
+    if (*src == '\n') { line ++; src ++; continue; }
+    if (*src == '"' || *src == '\'') {
+      // skip literals which are not part of a marker
+      char quote = *src ++;
+      while (*src != quote && *src != '\0') { if (*src == '\\') src ++; src ++; }
+      if (*src != '\0') src ++;
+      continue;
+    }
+    if (!isalpha(*src) && *src != '_') { src ++; continue; }
+
+    const char *ident = src;
+    while (isalnum(*src) || *src == '_') src ++;
+    int len = src - ident;
+#define is_marker(s) (len == sizeof(s) - 1 && strncmp(ident, s, len) == 0)
+    if (is_marker("__decode_tree_start__")) {
+      if (in_table) error("nested INSTPAT_START()");
+      read_marker_arg(name, sizeof(name));
+      in_table = true;
+      npat = 0;
+    } else if (is_marker("__decode_tree_pat__")) {
+      if (!in_table) error("INSTPAT() outside of INSTPAT_START() and INSTPAT_END()");
+      read_marker_arg(buf, sizeof(buf));
+      add_pattern(buf);
+    } else if (is_marker("__decode_tree_end__")) {
+      read_marker_arg(buf, sizeof(buf));
+      if (!in_table || strcmp(buf, name) != 0) error("unmatched INSTPAT_END()");
+      gen_table(name);
+      in_table = false;
+    }
+  }
+  if (in_table) error("missing INSTPAT_END()");
+  return 0;
+}
@@ -18,8 +18,9 @@
 #include <sys/prctl.h>
 #include <signal.h>
 
-bool gdb_connect_qemu(int);
+bool gdb_connect_qemu(const char *);
 bool gdb_memcpy_to_qemu(uint32_t, void *, int);
+bool gdb_memcpy_from_qemu(uint32_t, void *, int);
 bool gdb_getregs(union isa_gdb_regs *);
 bool gdb_setregs(union isa_gdb_regs *);
 bool gdb_si();
@@ -28,11 +29,13 @@ void gdb_exit();
 void init_isa();
 
 __EXPORT void difftest_memcpy(paddr_t addr, void *buf, size_t n, bool direction) {
-  assert(direction == DIFFTEST_TO_REF);
+  bool ok;
   if (direction == DIFFTEST_TO_REF) {
-    bool ok = gdb_memcpy_to_qemu(addr, buf, n);
-    assert(ok == 1);
+    ok = gdb_memcpy_to_qemu(addr, buf, n);
+  } else {
+    ok = gdb_memcpy_from_qemu(addr, buf, n);
   }
+  assert(ok == 1);
 }
 
 __EXPORT void difftest_regcpy(void *dut, bool direction) {
@@ -47,12 +50,18 @@ __EXPORT void difftest_regcpy(void *dut, bool direction) {
 }
 
 __EXPORT void difftest_exec(uint64_t n) {
-  while (n --) gdb_si();
+  while (n --) {
+    bool ok = gdb_si();
+    assert(ok == 1);
+  }
 }
 
 __EXPORT void difftest_init(int port) {
-  char buf[32];
-  sprintf(buf, "tcp::%d", port);
+  // a unix domain socket saves the TCP stack on every packet
+  char path[64], buf[128];
+  sprintf(path, "/tmp/nemu-qemu-%d-%d.sock", getpid(), port);
+  sprintf(buf, "unix:%s,server=on,wait=off", path);
+  unlink(path);
 
   int ppid_before_fork = getpid();
   int pid = fork();
@@ -84,8 +93,9 @@ __EXPORT void difftest_init(int port) {
   else {
     // father
 
-    gdb_connect_qemu(port);
-    printf("Connect to QEMU with %s successfully\n", buf);
+    gdb_connect_qemu(path);
+    printf("Connect to QEMU with %s successfully\n", path);
+    unlink(path);
 
     atexit(gdb_exit);
 
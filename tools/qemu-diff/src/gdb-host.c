@@ -16,53 +16,108 @@
 #include "common.h"
 
 static struct gdb_conn *conn;
+// the largest packet accepted by QEMU, including the framing
+static int packet_size = 1024;
 
-bool gdb_connect_qemu(int port) {
-  // connect to gdbserver on localhost port 1234
-  while ((conn = gdb_begin_inet("127.0.0.1", port)) == NULL) {
+bool gdb_connect_qemu(const char *path) {
+  // connect to gdbserver listening at a unix domain socket
+  while ((conn = gdb_begin_unix(path)) == NULL) {
     usleep(1);
   }
 
-  return true;
-}
+  // requests which do not resume the guest are sent without waiting for
+  // their replies, which is only possible without acknowledgments
+  bool ok = !strcmp(gdb_start_noack(conn), "OK");
+  assert(ok);
 
-static bool gdb_memcpy_to_qemu_small(uint32_t dest, void *src, int len) {
-  char *buf = malloc(len * 2 + 128);
-  assert(buf != NULL);
-  int p = sprintf(buf, "M0x%x,%x:", dest, len);
-  int i;
-  for (i = 0; i < len; i ++) {
-    p += sprintf(buf + p, "%c%c", hex_encode(((uint8_t *)src)[i] >> 4), hex_encode(((uint8_t *)src)[i] & 0xf));
-  }
+  gdb_send(conn, (const uint8_t *)"qSupported", 10);
+  size_t size;
+  char *reply = (char *)gdb_recv(conn, &size);
+  char *p = strstr(reply, "PacketSize=");
+  if (p != NULL) packet_size = strtol(p + 11, NULL, 16);
+  free(reply);
 
-  gdb_send(conn, (const uint8_t *)buf, strlen(buf));
-  free(buf);
+  return true;
+}
 
+static uint8_t *recv_reply() {
   size_t size;
-  uint8_t *reply = gdb_recv(conn, &size);
-  bool ok = !strcmp((const char*)reply, "OK");
-  free(reply);
+  return gdb_recv(conn, &size);
+}
 
+static bool recv_ok() {
+  uint8_t *reply = recv_reply();
+  bool ok = !strcmp((const char *)reply, "OK");
+  free(reply);
   return ok;
 }
 
+static bool is_escaped(uint8_t c) {
+  return c == '#' || c == '$' || c == '}' || c == '*';
+}
+
 bool gdb_memcpy_to_qemu(uint32_t dest, void *src, int len) {
-  const int mtu = 1500;
-  bool ok = true;
-  while (len > mtu) {
-    ok &= gdb_memcpy_to_qemu_small(dest, src, mtu);
-    dest += mtu;
-    src += mtu;
-    len -= mtu;
+  // write with binary 'X' packets, all of them are sent before the replies
+  // are received
+  uint8_t *buf = malloc(packet_size);
+  assert(buf != NULL);
+  uint8_t *data = src;
+  int nr_packet = 0;
+  while (len > 0) {
+    // leave room for the header and the framing
+    int room = packet_size - 32;
+    int n = 0;
+    for (int enc = 0; n < len && enc + 2 <= room; n ++) {
+      enc += (is_escaped(data[n]) ? 2 : 1);
+    }
+    int p = sprintf((char *)buf, "X%x,%x:", dest, n);
+    for (int i = 0; i < n; i ++) {
+      if (is_escaped(data[i])) {
+        buf[p ++] = '}';
+        buf[p ++] = data[i] ^ 0x20;
+      } else {
+        buf[p ++] = data[i];
+      }
+    }
+    gdb_send(conn, buf, p);
+    nr_packet ++;
+    dest += n;
+    data += n;
+    len -= n;
   }
-  ok &= gdb_memcpy_to_qemu_small(dest, src, len);
+  free(buf);
+
+  bool ok = true;
+  while (nr_packet -- > 0) ok &= recv_ok();
   return ok;
 }
 
+bool gdb_memcpy_from_qemu(uint32_t src, void *dest, int len) {
+  // each byte is read as two hex digits
+  int max = (packet_size - 32) / 2;
+  uint8_t *data = dest;
+  while (len > 0) {
+    int n = (len < max ? len : max);
+    char buf[64];
+    sprintf(buf, "m%x,%x", src, n);
+    gdb_send(conn, (const uint8_t *)buf, strlen(buf));
+    uint8_t *reply = recv_reply();
+    bool ok = (strlen((const char *)reply) == n * 2);
+    for (int i = 0; ok && i < n; i ++) {
+      data[i] = gdb_decode_hex(reply[i * 2], reply[i * 2 + 1]);
+    }
+    free(reply);
+    if (!ok) return false;
+    src += n;
+    data += n;
+    len -= n;
+  }
+  return true;
+}
+
 bool gdb_getregs(union isa_gdb_regs *r) {
   gdb_send(conn, (const uint8_t *)"g", 1);
-  size_t size;
-  uint8_t *reply = gdb_recv(conn, &size);
+  uint8_t *reply = recv_reply();
 
   int i;
   uint8_t *p = reply;
@@ -96,21 +151,18 @@ bool gdb_setregs(union isa_gdb_regs *r) {
   gdb_send(conn, (const uint8_t *)buf, strlen(buf));
   free(buf);
 
-  size_t size;
-  uint8_t *reply = gdb_recv(conn, &size);
-  bool ok = !strcmp((const char*)reply, "OK");
-  free(reply);
-
-  return ok;
+  return recv_ok();
 }
 
+// QEMU does not read the next packet reliably while the guest is running,
+// so the stop reply of a step is waited for before anything else is sent
 bool gdb_si() {
   char buf[] = "vCont;s:1";
   gdb_send(conn, (const uint8_t *)buf, strlen(buf));
-  size_t size;
-  uint8_t *reply = gdb_recv(conn, &size);
+  uint8_t *reply = recv_reply();
+  bool ok = (reply[0] == 'T' || reply[0] == 'S');
   free(reply);
-  return true;
+  return ok;
 }
 
 void gdb_exit() {
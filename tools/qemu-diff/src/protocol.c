@@ -28,6 +28,7 @@
 
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
 
 struct gdb_conn {
   FILE *in;
@@ -85,6 +86,11 @@ static struct gdb_conn* gdb_begin(int fd) {
   if (conn->out == NULL)
     err(1, "fdopen");
 
+  // packets are only written to the socket when a reply is waited for, so
+  // that a batch of them goes out with a single write
+  if (setvbuf(conn->out, NULL, _IOFBF, 1 << 16) != 0)
+    err(1, "setvbuf");
+
   // reset line state by acking any earlier input
   fputc('+', conn->out);
   fflush(conn->out);
@@ -128,6 +134,23 @@ struct gdb_conn* gdb_begin_inet(const char *addr, uint16_t port) {
   return gdb_begin(fd);
 }
 
+struct gdb_conn* gdb_begin_unix(const char *path) {
+  struct sockaddr_un sa = { .sun_family = AF_UNIX };
+  if (strlen(path) >= sizeof(sa.sun_path))
+    errx(1, "Path too long: %s", path);
+  strcpy(sa.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    err(1, "socket");
+  if (connect(fd, (const struct sockaddr *)&sa, sizeof(sa)) != 0) {
+    close(fd);
+    return NULL;
+  }
+
+  return gdb_begin(fd);
+}
+
 
 void gdb_end(struct gdb_conn *conn) {
   fclose(conn->in);
@@ -149,7 +172,6 @@ static void send_packet(FILE *out, const uint8_t *command, size_t size) {
   fputc('$', out); // packet start
   fwrite(command, 1, size, out); // payload
   fprintf(out, "#%02X", sum); // packet end, checksum
-  fflush(out);
 
   if (ferror(out))
     err(1, "send");
@@ -162,10 +184,12 @@ void gdb_send(struct gdb_conn *conn, const uint8_t *command, size_t size) {
   do {
     send_packet(conn->out, command, size);
 
+    // without acks, the packet stays buffered until the next gdb_recv()
     if (!conn->ack)
       break;
 
     // look for '+' ACK or '-' NACK/resend
+    fflush(conn->out);
     acked = fgetc(conn->in) == '+';
   } while (!acked);
 }
@@ -276,6 +300,9 @@ static uint8_t* recv_packet(FILE *in, size_t *ret_size, bool* ret_sum_ok) {
 uint8_t* gdb_recv(struct gdb_conn *conn, size_t *size) {
   uint8_t *reply;
   bool acked = false;
+  // send the pending packets before waiting for a reply
+  if (fflush(conn->out) != 0)
+    err(1, "send");
   do {
     reply = recv_packet(conn->in, size, &acked);
 